@@ -0,0 +1,87 @@
+//
+// Created by Matthew Emerson on 2/24/22.
+//
+
+#include <stdio.h>
+#include <inttypes.h>
+#include <time.h>
+#include <unistd.h>
+#include "touchstone.h"
+#include "hash.h"
+
+#define BENCH_PAGE_SIZE     65536
+#define BENCH_LOOKUPS       10000000
+
+double elapsed_ns(struct timespec *start, struct timespec *end) {
+    return (end->tv_sec - start->tv_sec) * 1e9 + (end->tv_nsec - start->tv_nsec);
+}
+
+Table *open_bench_table(char *filename, TableType type) {
+    int fd = mkstemp(filename);
+    close(fd);
+    unlink(filename);
+    Table *table = open_db(filename, BENCH_PAGE_SIZE, type);
+    if (table == NULL) {
+        exit(EXIT_FAILURE);
+    }
+    return table;
+}
+
+double bench_inserts(Table *table, uint32_t num_rows) {
+    struct timespec start, end;
+    Row row;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (uint32_t i = 1; i <= num_rows; i++) {
+        row.id = i;
+        snprintf(row.username, sizeof(row.username), "user%d", i);
+        snprintf(row.email, sizeof(row.email), "user%d@example.com", i);
+        table_insert(table, &row);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return elapsed_ns(&start, &end) / num_rows;
+}
+
+double bench_lookups(Table *table, uint32_t num_rows, uint64_t *checksum) {
+    // Keys past num_rows miss, so both the hit and miss paths are exercised
+    struct timespec start, end;
+    Row row;
+    uint32_t key = 1;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (uint32_t i = 0; i < BENCH_LOOKUPS; i++) {
+        key = (key * 1103515245 + 12345) % (num_rows + num_rows / 8) + 1;
+        if (table_lookup(table, key, &row)) {
+            *checksum += row.id;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return elapsed_ns(&start, &end) / BENCH_LOOKUPS;
+}
+
+int main() {
+    char btree_filename[] = "/tmp/touchstone_bench_XXXXXX";
+    char hash_filename[] = "/tmp/touchstone_bench_XXXXXX";
+    Table *btree = open_bench_table(btree_filename, TABLE_BTREE);
+    Table *hash = open_bench_table(hash_filename, TABLE_HASH);
+
+    // Stay within what a B-tree root without internal splits can hold
+    uint32_t num_rows = 3 * btree->pager->leaf_node_left_split_count;
+    double btree_insert_ns = bench_inserts(btree, num_rows);
+    double hash_insert_ns = bench_inserts(hash, num_rows);
+
+    uint64_t btree_checksum = 0;
+    uint64_t hash_checksum = 0;
+    double btree_lookup_ns = bench_lookups(btree, num_rows, &btree_checksum);
+    double hash_lookup_ns = bench_lookups(hash, num_rows, &hash_checksum);
+
+    printf("rows: %d, page size: %d, hash buckets: %d\n", num_rows, BENCH_PAGE_SIZE, hash->pager->num_pages - 1);
+    printf("btree: %.1f ns/insert, %.1f ns/lookup\n", btree_insert_ns, btree_lookup_ns);
+    printf("hash:  %.1f ns/insert, %.1f ns/lookup\n", hash_insert_ns, hash_lookup_ns);
+    // Both tables must find the same rows
+    printf("checksums: %" PRIu64 " %" PRIu64 "\n", btree_checksum, hash_checksum);
+
+    close_db(btree);
+    close_db(hash);
+    unlink(btree_filename);
+    unlink(hash_filename);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,73 @@
+//
+// Created by Matthew Emerson on 2/16/22.
+//
+
+#include <stdio.h>
+#include <inttypes.h>
+#include <time.h>
+#include <unistd.h>
+#include "touchstone.h"
+#include "learned.h"
+
+#define BENCH_PAGE_SIZE     65536
+#define BENCH_LOOKUPS       10000000
+
+double elapsed_ns(struct timespec *start, struct timespec *end) {
+    return (end->tv_sec - start->tv_sec) * 1e9 + (end->tv_nsec - start->tv_nsec);
+}
+
+int main() {
+    char filename[] = "/tmp/touchstone_bench_XXXXXX";
+    int fd = mkstemp(filename);
+    close(fd);
+    unlink(filename);
+
+    Table *table = open_db(filename, BENCH_PAGE_SIZE, TABLE_BTREE);
+    if (table == NULL) {
+        return EXIT_FAILURE;
+    }
+    uint32_t num_rows = 3 * table->pager->leaf_node_left_split_count;
+    Row row;
+    for (uint32_t i = 1; i <= num_rows; i++) {
+        row.id = i;
+        snprintf(row.username, sizeof(row.username), "user%d", i);
+        snprintf(row.email, sizeof(row.email), "user%d@example.com", i);
+        table_insert(table, &row);
+    }
+    LearnedIndex *index = new_learned_index(table);
+
+    struct timespec start, end;
+    uint64_t checksum = 0;
+    uint32_t key = 1;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (uint32_t i = 0; i < BENCH_LOOKUPS; i++) {
+        key = (key * 1103515245 + 12345) % num_rows + 1;
+        Cursor *cursor = table_find(table, key);
+        checksum += cursor->cell_num;
+        free(cursor);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double btree_ns = elapsed_ns(&start, &end) / BENCH_LOOKUPS;
+
+    key = 1;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (uint32_t i = 0; i < BENCH_LOOKUPS; i++) {
+        key = (key * 1103515245 + 12345) % num_rows + 1;
+        Cursor *cursor = learned_index_find(index, table, key);
+        checksum -= cursor->cell_num;
+        free(cursor);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double learned_ns = elapsed_ns(&start, &end) / BENCH_LOOKUPS;
+
+    printf("rows: %d, segments: %d, error window: %d\n", num_rows, index->num_segments, index->max_error);
+    printf("btree descent: %.1f ns/lookup\n", btree_ns);
+    printf("learned index: %.1f ns/lookup (%" PRIu64 " hits, %" PRIu64 " misses)\n", learned_ns, index->hits, index->misses);
+    // Both paths must land on the same cells
+    printf("checksum: %" PRIu64 "\n", checksum);
+
+    free(index);
+    close_db(table);
+    unlink(filename);
+    return EXIT_SUCCESS;
+}
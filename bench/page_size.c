@@ -0,0 +1,81 @@
+//
+// Created by Matthew Emerson on 2/14/22.
+//
+
+#include <stdio.h>
+#include <inttypes.h>
+#include <time.h>
+#include <unistd.h>
+#include "touchstone.h"
+
+#define BENCH_LOOKUPS       1000000
+#define BENCH_SCAN_ROUNDS   10000
+
+double elapsed_ns(struct timespec *start, struct timespec *end) {
+    return (end->tv_sec - start->tv_sec) * 1e9 + (end->tv_nsec - start->tv_nsec);
+}
+
+void bench_page_size(uint32_t page_size) {
+    char filename[] = "/tmp/touchstone_bench_XXXXXX";
+    int fd = mkstemp(filename);
+    close(fd);
+    unlink(filename);
+
+    // Sequential inserts leave full left leaves; stay within what a root without internal splits can hold
+    Table *table = open_db(filename, page_size, TABLE_BTREE);
+    if (table == NULL) {
+        exit(EXIT_FAILURE);
+    }
+    uint32_t num_rows = 3 * table->pager->leaf_node_left_split_count;
+    Row row;
+    for (uint32_t i = 1; i <= num_rows; i++) {
+        row.id = i;
+        snprintf(row.username, sizeof(row.username), "user%d", i);
+        snprintf(row.email, sizeof(row.email), "user%d@example.com", i);
+        table_insert(table, &row);
+    }
+    close_db(table);
+
+    // Reopen so the first scan starts from a cold page cache
+    table = open_db(filename, 0, TABLE_BTREE);
+    if (table == NULL) {
+        exit(EXIT_FAILURE);
+    }
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    uint64_t checksum = 0;
+    for (uint32_t round = 0; round < BENCH_SCAN_ROUNDS; round++) {
+        Cursor *cursor = table_start(table);
+        while (!cursor->end_of_table) {
+            deserialize_row(cursor_ptr(cursor), &row);
+            checksum += row.id;
+            cursor_advance(cursor);
+        }
+        free(cursor);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double scan_ns = elapsed_ns(&start, &end) / ((double) BENCH_SCAN_ROUNDS * num_rows);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    uint32_t key = 1;
+    for (uint32_t i = 0; i < BENCH_LOOKUPS; i++) {
+        key = (key * 1103515245 + 12345) % num_rows + 1;
+        Cursor *cursor = table_find(table, key);
+        checksum += cursor->cell_num;
+        free(cursor);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double lookup_ns = elapsed_ns(&start, &end) / BENCH_LOOKUPS;
+
+    printf("%8d %8d %12.1f %12.1f %16" PRIu64 "\n", page_size, num_rows, scan_ns, lookup_ns, checksum);
+    close_db(table);
+    unlink(filename);
+}
+
+int main() {
+    printf("%8s %8s %12s %12s %16s\n", "page", "rows", "scan ns/row", "lookup ns", "checksum");
+    for (uint32_t page_size = MIN_PAGE_SIZE; page_size <= MAX_PAGE_SIZE; page_size *= 2) {
+        bench_page_size(page_size);
+    }
+    return EXIT_SUCCESS;
+}
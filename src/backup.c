@@ -0,0 +1,206 @@
+//
+// Created by Matthew Emerson on 2/20/22.
+//
+
+#include <memory.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include "backup.h"
+
+double backup_now() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double) now.tv_sec + (double) now.tv_nsec / 1e9;
+}
+
+bool backup_needs_copy(Backup *backup, Pager *pager, uint32_t page_num) {
+    return !backup->copied[page_num] || pager->page_changed_at[page_num] > backup->copied_at[page_num];
+}
+
+uint32_t backup_copy_chunk(Backup *backup, uint32_t *start, void *buffer) {
+    // Caller holds the table lock; gathers the next run of contiguous pages that need copying
+    Pager *pager = backup->table->pager;
+    uint32_t page_num = *start;
+    while (page_num < pager->num_pages && !backup_needs_copy(backup, pager, page_num)) {
+        page_num++;
+    }
+    *start = page_num;
+
+    uint32_t run_len = 0;
+    while (run_len < BACKUP_CHUNK_PAGES && page_num < pager->num_pages && backup_needs_copy(backup, pager, page_num)) {
+        memcpy(buffer + (size_t) run_len * pager->page_size, get_page(pager, page_num), pager->page_size);
+        if (backup->copied[page_num]) {
+            backup->pages_recopied++;
+        } else {
+            backup->pages_copied++;
+        }
+        backup->copied[page_num] = true;
+        backup->copied_at[page_num] = pager->page_changed_at[page_num];
+        run_len++;
+        page_num++;
+    }
+    return run_len;
+}
+
+bool backup_write(Backup *backup, void *buffer, size_t len, off_t offset) {
+    size_t written = 0;
+    while (written < len) {
+        ssize_t bytes_written = pwrite(backup->fd, buffer + written, len - written, offset + (off_t) written);
+        if (bytes_written == -1) {
+            printf("Error: Unable to write backup '%s': %d\n", backup->path, errno);
+            return false;
+        }
+        written += bytes_written;
+    }
+    backup->bytes_written += len;
+    return true;
+}
+
+void backup_throttle(Backup *backup, double started) {
+    if (backup->bytes_per_sec == 0) {
+        return;
+    }
+    // Sleep until the average rate since the start is back under the limit
+    double behind = (double) backup->bytes_written / (double) backup->bytes_per_sec - (backup_now() - started);
+    if (behind > 0) {
+        struct timespec delay = {(time_t) behind, (long) ((behind - (double) (time_t) behind) * 1e9)};
+        nanosleep(&delay, NULL);
+    }
+}
+
+uint32_t backup_pass(Backup *backup, void *buffer, bool locked, double started) {
+    // A final pass runs with the lock already held so nothing can change behind it
+    Table *table = backup->table;
+    uint32_t pages_written = 0;
+    uint32_t start = 0;
+    while (!backup->failed) {
+        if (!locked) {
+            table_lock(table);
+        }
+        uint32_t run_len = backup_copy_chunk(backup, &start, buffer);
+        off_t offset = pager_page_offset(table->pager, start);
+        if (!locked) {
+            table_unlock(table);
+        }
+        if (run_len == 0) {
+            break;
+        }
+
+        if (!backup_write(backup, buffer, (size_t) run_len * table->pager->page_size, offset)) {
+            backup->failed = true;
+            break;
+        }
+        pages_written += run_len;
+        start += run_len;
+        if (!locked) {
+            backup_throttle(backup, started);
+        }
+    }
+    backup->passes++;
+    return pages_written;
+}
+
+void *backup_worker(void *arg) {
+    Backup *backup = arg;
+    Table *table = backup->table;
+    void *buffer = malloc((size_t) BACKUP_CHUNK_PAGES * table->pager->page_size);
+    double started = backup_now();
+
+    table_lock(table);
+    off_t header_size = table->pager->header_size;
+    if (header_size > 0) {
+        // The header is only written when the file is created, so it can be copied straight from disk
+        if (pread(table->pager->fd, buffer, header_size, 0) != header_size) {
+            printf("Error: Unable to read DB file header: %d\n", errno);
+            backup->failed = true;
+        }
+    }
+    table_unlock(table);
+    if (header_size > 0 && !backup->failed) {
+        backup->failed = !backup_write(backup, buffer, header_size, 0);
+    }
+
+    // Keep re-copying pages the foreground modified until few enough remain to finish under the lock
+    uint32_t changed = backup_pass(backup, buffer, false, started);
+    while (!backup->failed && changed > BACKUP_FINAL_PASS_PAGES && backup->passes < BACKUP_MAX_PASSES) {
+        changed = backup_pass(backup, buffer, false, started);
+    }
+
+    table_lock(table);
+    backup_pass(backup, buffer, true, started);
+    backup->num_pages = table->pager->num_pages;
+    off_t file_len = pager_page_offset(table->pager, backup->num_pages);
+    // A copy-on-write root is rarely page 0; recording it in the header makes the copy relink from it on open
+    uint32_t root_page_num = table->root_page_num;
+    table_unlock(table);
+
+    if (!backup->failed && header_size > 0) {
+        backup->failed = !backup_write(backup, &root_page_num, sizeof(uint32_t), FILE_HEADER_ROOT_PAGE_OFFSET);
+    }
+
+    if (!backup->failed && ftruncate(backup->fd, file_len) == -1) {
+        printf("Error: Unable to truncate backup '%s': %d\n", backup->path, errno);
+        backup->failed = true;
+    }
+    if (!backup->failed && fsync(backup->fd) == -1) {
+        printf("Error: Unable to sync backup '%s': %d\n", backup->path, errno);
+        backup->failed = true;
+    }
+    close(backup->fd);
+    free(buffer);
+
+    atomic_store(&backup->done, true);
+    return NULL;
+}
+
+Backup *backup_start(Table *table, const char *path, uint64_t bytes_per_sec) {
+    if (strlen(path) >= BACKUP_FILENAME_SIZE) {
+        printf("Error: Backup path too long\n");
+        return NULL;
+    }
+    if (table->copy_on_write && table->pager->header_size == 0) {
+        // Without a header the copy has nowhere to record a root that moved off page 0
+        printf("Error: Copy-on-write tables need a file header to back up\n");
+        return NULL;
+    }
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    if (fd == -1) {
+        printf("Error: Unable to open backup '%s': %d\n", path, errno);
+        return NULL;
+    }
+
+    Backup *backup = malloc(sizeof(Backup));
+    backup->table = table;
+    backup->fd = fd;
+    strcpy(backup->path, path);
+    backup->bytes_per_sec = bytes_per_sec;
+    for (uint32_t i = 0; i < TABLE_MAX_PAGES; i++) {
+        backup->copied_at[i] = 0;
+        backup->copied[i] = false;
+    }
+    backup->bytes_written = 0;
+    backup->pages_copied = 0;
+    backup->pages_recopied = 0;
+    backup->passes = 0;
+    backup->num_pages = 0;
+    backup->done = false;
+    backup->failed = false;
+
+    pthread_create(&backup->thread, NULL, backup_worker, backup);
+    return backup;
+}
+
+bool backup_done(Backup *backup) {
+    return atomic_load(&backup->done);
+}
+
+bool backup_finish(Backup *backup) {
+    // Waits for the copy to complete, then releases it
+    pthread_join(backup->thread, NULL);
+    bool succeeded = !backup->failed;
+    free(backup);
+    return succeeded;
+}
@@ -0,0 +1,40 @@
+//
+// Created by Matthew Emerson on 2/20/22.
+//
+
+#ifndef TOUCHSTONE_BACKUP_H
+#define TOUCHSTONE_BACKUP_H
+
+#include <pthread.h>
+#include "db.h"
+
+#define BACKUP_CHUNK_PAGES      16
+#define BACKUP_MAX_PASSES       8
+// Stop re-copying without the lock once a pass finds this few changed pages
+#define BACKUP_FINAL_PASS_PAGES BACKUP_CHUNK_PAGES
+#define BACKUP_FILENAME_SIZE    4096
+
+typedef struct Backup {
+    Table *table;
+    int fd;
+    char path[BACKUP_FILENAME_SIZE];
+    // 0 copies as fast as the disk allows
+    uint64_t bytes_per_sec;
+    pthread_t thread;
+    // Source change counter of each page when it was last copied
+    uint64_t copied_at[TABLE_MAX_PAGES];
+    bool copied[TABLE_MAX_PAGES];
+    uint64_t bytes_written;
+    uint32_t pages_copied;
+    uint32_t pages_recopied;
+    uint32_t passes;
+    uint32_t num_pages;
+    _Atomic bool done;
+    bool failed;
+} Backup;
+
+Backup *backup_start(Table *table, const char *path, uint64_t bytes_per_sec);
+bool backup_done(Backup *backup);
+bool backup_finish(Backup *backup);
+
+#endif //TOUCHSTONE_BACKUP_H
@@ -8,8 +8,10 @@
 
 PrepareResult prepare_insert(InputBuffer *input, Statement *statement) {
     statement->type =STATEMENT_INSERT;
+    statement->param_columns = 0;
 
-    char *keyword = strtok(input->buffer, " ");
+    // Skip the keyword
+    strtok(input->buffer, " ");
     char *id_str = strtok(NULL, " ");
     char *username = strtok(NULL, " ");
     char *email = strtok(NULL, " ");
@@ -26,24 +28,196 @@ PrepareResult prepare_insert(InputBuffer *input, Statement *statement) {
         return PREPARE_ERROR_OUT_OF_BOUNDS;
     }
 
-    int id = atoi(id_str);
-    if (id < 0) {
-        return PREPARE_ERROR_OUT_OF_BOUNDS;
+    // '?' leaves a column to be bound later through the library API
+    if (strcmp(id_str, "?") == 0) {
+        statement->param_columns |= 1 << COLUMN_ID;
+        statement->row_to_insert.id = 0;
+    } else {
+        int id = atoi(id_str);
+        if (id < 0) {
+            return PREPARE_ERROR_OUT_OF_BOUNDS;
+        }
+        statement->row_to_insert.id = id;
+    }
+    if (strcmp(username, "?") == 0) {
+        statement->param_columns |= 1 << COLUMN_USERNAME;
+        username = "";
+    }
+    if (strcmp(email, "?") == 0) {
+        statement->param_columns |= 1 << COLUMN_EMAIL;
+        email = "";
     }
-    statement->row_to_insert.id = id;
     strcpy(statement->row_to_insert.username, username);
     strcpy(statement->row_to_insert.email, email);
 
     return PREPARE_SUCCESS;
 }
 
+PrepareResult prepare_select(InputBuffer *input, Statement *statement) {
+    statement->type = STATEMENT_SELECT;
+    statement->param_columns = 0;
+    statement->select.point = false;
+    statement->select.key = 0;
+    statement->select.ordered = false;
+    statement->select.order_column = COLUMN_ID;
+    statement->select.descending = false;
+    statement->select.limit = 0;
+
+    // Skip the keyword
+    strtok(input->buffer, " ");
+    char *token = strtok(NULL, " ");
+
+    // select [where id = <key>] [order by <column> [asc|desc]] [limit <k>]
+    if (token != NULL && strcasecmp(token, "where") == 0) {
+        char *column = strtok(NULL, " ");
+        char *equals = strtok(NULL, " ");
+        char *key_str = strtok(NULL, " ");
+        if (column == NULL || strcasecmp(column, "id") != 0 || equals == NULL || strcmp(equals, "=") != 0 ||
+            key_str == NULL) {
+            return PREPARE_ERROR_SYNTAX;
+        }
+        int key = atoi(key_str);
+        if (key < 0) {
+            return PREPARE_ERROR_OUT_OF_BOUNDS;
+        }
+        statement->select.point = true;
+        statement->select.key = key;
+        token = strtok(NULL, " ");
+    }
+
+    if (token != NULL && strcasecmp(token, "order") == 0) {
+        char *by = strtok(NULL, " ");
+        char *column = strtok(NULL, " ");
+        if (by == NULL || strcasecmp(by, "by") != 0 || column == NULL) {
+            return PREPARE_ERROR_SYNTAX;
+        }
+
+        if (strcasecmp(column, "id") == 0) {
+            statement->select.order_column = COLUMN_ID;
+        } else if (strcasecmp(column, "username") == 0) {
+            statement->select.order_column = COLUMN_USERNAME;
+        } else if (strcasecmp(column, "email") == 0) {
+            statement->select.order_column = COLUMN_EMAIL;
+        } else {
+            return PREPARE_ERROR_SYNTAX;
+        }
+        statement->select.ordered = true;
+
+        token = strtok(NULL, " ");
+        if (token != NULL && strcasecmp(token, "desc") == 0) {
+            statement->select.descending = true;
+            token = strtok(NULL, " ");
+        } else if (token != NULL && strcasecmp(token, "asc") == 0) {
+            token = strtok(NULL, " ");
+        }
+    }
+
+    if (token != NULL && strcasecmp(token, "limit") == 0) {
+        char *limit_str = strtok(NULL, " ");
+        if (limit_str == NULL) {
+            return PREPARE_ERROR_SYNTAX;
+        }
+        int limit = atoi(limit_str);
+        if (limit <= 0) {
+            return PREPARE_ERROR_OUT_OF_BOUNDS;
+        }
+        statement->select.limit = limit;
+        token = strtok(NULL, " ");
+    }
+
+    if (token != NULL) {
+        return PREPARE_ERROR_SYNTAX;
+    }
+
+    return PREPARE_SUCCESS;
+}
+
+PrepareResult prepare_copy(InputBuffer *input, Statement *statement) {
+    statement->type = STATEMENT_COPY;
+    statement->param_columns = 0;
+
+    // Filenames are single-quoted and may contain spaces: 'path'
+    char *open_quote = strchr(input->buffer, '\'');
+    char *close_quote = open_quote == NULL ? NULL : strchr(open_quote + 1, '\'');
+    if (close_quote == NULL || close_quote == open_quote + 1 || (close_quote[1] != '\0' && close_quote[1] != ' ')) {
+        return PREPARE_ERROR_SYNTAX;
+    }
+    size_t filename_len = close_quote - open_quote - 1;
+    if (filename_len > COPY_FILENAME_SIZE) {
+        return PREPARE_ERROR_OUT_OF_BOUNDS;
+    }
+    memcpy(statement->copy.filename, open_quote + 1, filename_len);
+    statement->copy.filename[filename_len] = '\0';
+
+    *open_quote = '\0';
+    // Skip the keyword
+    strtok(input->buffer, " ");
+    char *table_name = strtok(NULL, " ");
+    char *direction = strtok(NULL, " ");
+    if (table_name == NULL || direction == NULL || strtok(NULL, " ") != NULL) {
+        return PREPARE_ERROR_SYNTAX;
+    }
+    char *format = strtok(close_quote + 1, " ");
+    if (format != NULL && strtok(NULL, " ") != NULL) {
+        return PREPARE_ERROR_SYNTAX;
+    }
+
+    if (strcasecmp(direction, "from") == 0) {
+        statement->copy.direction = COPY_FROM;
+    } else if (strcasecmp(direction, "to") == 0) {
+        statement->copy.direction = COPY_TO;
+    } else {
+        return PREPARE_ERROR_SYNTAX;
+    }
+
+    if (format == NULL || strcasecmp(format, "csv") == 0) {
+        statement->copy.format = COPY_FORMAT_CSV;
+    } else if (strcasecmp(format, "binary") == 0) {
+        statement->copy.format = COPY_FORMAT_BINARY;
+    } else {
+        return PREPARE_ERROR_SYNTAX;
+    }
+
+    return PREPARE_SUCCESS;
+}
+
+PrepareResult prepare_delete(InputBuffer *input, Statement *statement) {
+    statement->type = STATEMENT_DELETE;
+    statement->param_columns = 0;
+
+    // delete where id = <key>
+    // Skip the keyword
+    strtok(input->buffer, " ");
+    char *where = strtok(NULL, " ");
+    char *column = strtok(NULL, " ");
+    char *equals = strtok(NULL, " ");
+    char *key_str = strtok(NULL, " ");
+    if (where == NULL || strcasecmp(where, "where") != 0 || column == NULL || strcasecmp(column, "id") != 0 ||
+        equals == NULL || strcmp(equals, "=") != 0 || key_str == NULL || strtok(NULL, " ") != NULL) {
+        return PREPARE_ERROR_SYNTAX;
+    }
+
+    int key = atoi(key_str);
+    if (key < 0) {
+        return PREPARE_ERROR_OUT_OF_BOUNDS;
+    }
+    statement->key_to_delete = key;
+
+    return PREPARE_SUCCESS;
+}
+
 PrepareResult prepare_statement(InputBuffer *input, Statement *statement) {
     if (strncasecmp(input->buffer, "insert", 6) == 0) {
         return prepare_insert(input, statement);
     }
     if (strncasecmp(input->buffer, "select", 6) == 0) {
-        statement->type = STATEMENT_SELECT;
-        return PREPARE_SUCCESS;
+        return prepare_select(input, statement);
+    }
+    if (strncasecmp(input->buffer, "copy", 4) == 0) {
+        return prepare_copy(input, statement);
+    }
+    if (strncasecmp(input->buffer, "delete", 6) == 0) {
+        return prepare_delete(input, statement);
     }
 
     return PREPARE_ERROR_NOT_FOUND;
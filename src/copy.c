@@ -0,0 +1,510 @@
+//
+// Created by Matthew Emerson on 2/6/22.
+//
+
+#include <memory.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include "copy.h"
+#include "learned.h"
+
+CopyBuffer *new_copy_buffer(int fd) {
+    CopyBuffer *buffer = malloc(sizeof(CopyBuffer));
+    buffer->fd = fd;
+    buffer->data = malloc(COPY_BUFFER_SIZE);
+    buffer->len = 0;
+    buffer->position = 0;
+    buffer->eof = false;
+    return buffer;
+}
+
+void close_copy_buffer(CopyBuffer *buffer) {
+    free(buffer->data);
+    free(buffer);
+}
+
+bool copy_buffer_fill(CopyBuffer *buffer) {
+    // Keep the unconsumed tail and top the buffer back up from the file
+    size_t remaining = buffer->len - buffer->position;
+    memmove(buffer->data, buffer->data + buffer->position, remaining);
+    buffer->len = remaining;
+    buffer->position = 0;
+
+    while (buffer->len < COPY_BUFFER_SIZE) {
+        ssize_t bytes_read = read(buffer->fd, buffer->data + buffer->len, COPY_BUFFER_SIZE - buffer->len);
+        if (bytes_read == -1) {
+            printf("Error: Unable to read copy file: %d\n", errno);
+            return false;
+        }
+        if (bytes_read == 0) {
+            buffer->eof = true;
+            break;
+        }
+        buffer->len += bytes_read;
+    }
+    return true;
+}
+
+bool copy_buffer_flush(CopyBuffer *buffer) {
+    size_t written = 0;
+    while (written < buffer->len) {
+        ssize_t bytes_written = write(buffer->fd, buffer->data + written, buffer->len - written);
+        if (bytes_written == -1) {
+            printf("Error: Unable to write copy file: %d\n", errno);
+            return false;
+        }
+        written += bytes_written;
+    }
+    buffer->len = 0;
+    return true;
+}
+
+bool copy_buffer_write(CopyBuffer *buffer, const void *source, size_t len) {
+    if (buffer->len + len > COPY_BUFFER_SIZE && !copy_buffer_flush(buffer)) {
+        return false;
+    }
+    memcpy(buffer->data + buffer->len, source, len);
+    buffer->len += len;
+    return true;
+}
+
+void copy_appender_finish(CopyAppender *appender) {
+    // Publish the appended cells once per leaf instead of once per row
+    if (appender->changed) {
+        pager_mark_dirty(appender->table->pager, appender->page_num);
+        LearnedIndex *learned_index = table_learned_index(appender->table);
+        if (learned_index != NULL) {
+            learned_index_leaf_changed(learned_index, appender->table, appender->page_num);
+        }
+        appender->changed = false;
+    }
+    appender->found = false;
+}
+
+ExecuteResult copy_insert(CopyAppender *appender, Row *row) {
+    // Keys above the current maximum go straight into the rightmost leaf without a search or cell shifts;
+    // anything else, and a full leaf, takes the regular insert path
+    Table *table = appender->table;
+    if (table->pager->type != TABLE_BTREE || table->copy_on_write) {
+        return table_insert(table, row);
+    }
+
+    if (!appender->found) {
+        // The rightmost leaf is reached through right children only, so no internal key tracks its maximum
+        uint32_t page_num = table->root_page_num;
+        void *node = get_page(table->pager, page_num);
+        while (get_node_type(node) == INTERNAL_NODE) {
+            page_num = *internal_node_right_child(node);
+            node = get_page(table->pager, page_num);
+        }
+        appender->page_num = page_num;
+        appender->found = true;
+    }
+
+    void *leaf = get_page(table->pager, appender->page_num);
+    uint32_t num_cells = *leaf_node_num_cells(leaf);
+    if (num_cells >= table->pager->leaf_node_max_cells || (num_cells > 0 && row->id <= *leaf_node_key(leaf, num_cells - 1))) {
+        copy_appender_finish(appender);
+        return table_insert(table, row);
+    }
+
+    *leaf_node_key(leaf, num_cells) = row->id;
+    serialize_row(row, leaf_node_value(leaf, num_cells));
+    *leaf_node_num_cells(leaf) = num_cells + 1;
+    appender->changed = true;
+    return EXECUTE_SUCCESS;
+}
+
+bool parse_csv_id(const char *field, size_t len, uint32_t *id) {
+    if (len == 0 || len > 10) {
+        return false;
+    }
+
+    uint64_t value = 0;
+    for (size_t i = 0; i < len; i++) {
+        if (field[i] < '0' || field[i] > '9') {
+            return false;
+        }
+        value = value * 10 + (field[i] - '0');
+    }
+    if (value > INT32_MAX) {
+        return false;
+    }
+
+    *id = (uint32_t) value;
+    return true;
+}
+
+bool parse_csv_field(char **position, char *end, char *destination, size_t max_len, size_t *len) {
+    // Reads one field and leaves *position on the comma or line end after it. A quoted field may hold
+    // commas, newlines and doubled quotes; unquoted ones are delimited with memchr, which libc vectorizes
+    char *field = *position;
+    size_t field_len = 0;
+    if (field < end && *field == '"') {
+        field++;
+        while (1) {
+            if (field == end) {
+                return false;
+            }
+            if (*field == '"') {
+                if (field + 1 == end || field[1] != '"') {
+                    field++;
+                    break;
+                }
+                field++;
+            }
+            if (field_len == max_len) {
+                return false;
+            }
+            destination[field_len++] = *field++;
+        }
+        if (field < end && *field != ',') {
+            return false;
+        }
+    } else {
+        char *comma = memchr(field, ',', end - field);
+        char *field_end = comma != NULL ? comma : end;
+        field_len = field_end - field;
+        if (field_len > max_len) {
+            return false;
+        }
+        memcpy(destination, field, field_len);
+        field = field_end;
+    }
+    *position = field;
+    *len = field_len;
+    return true;
+}
+
+bool parse_csv_line(char *line, size_t len, Row *row) {
+    char *line_end = line + len;
+    if (line_end > line && line_end[-1] == '\r') {
+        line_end--;
+    }
+
+    char *position = line;
+    char id[10];
+    size_t id_len;
+    size_t username_len;
+    size_t email_len;
+    if (!parse_csv_field(&position, line_end, id, sizeof(id), &id_len) || position == line_end ||
+        !parse_csv_id(id, id_len, &row->id)) {
+        return false;
+    }
+    position++;
+    if (!parse_csv_field(&position, line_end, row->username, COLUMN_USERNAME_SIZE, &username_len) ||
+        position == line_end) {
+        return false;
+    }
+    position++;
+    if (!parse_csv_field(&position, line_end, row->email, COLUMN_EMAIL_SIZE, &email_len) ||
+        position != line_end) {
+        return false;
+    }
+    row->username[username_len] = '\0';
+    row->email[email_len] = '\0';
+    return true;
+}
+
+char *csv_record_end(char *record, size_t len) {
+    // Newline ending the record, skipping newlines inside quoted fields; NULL if it is not buffered yet
+    char *newline = memchr(record, '\n', len);
+    if (newline == NULL || memchr(record, '"', newline - record) == NULL) {
+        return newline;
+    }
+    // Only a quote opening a field starts a quoted run, so a stray quote inside an unquoted field is plain text
+    bool quoted = false;
+    bool field_start = true;
+    bool closed_quote = false;
+    for (char *c = record; c < record + len; c++) {
+        if (quoted) {
+            if (*c == '"') {
+                quoted = false;
+                closed_quote = true;
+            }
+            continue;
+        }
+        if (*c == '"' && (field_start || closed_quote)) {
+            // A quote right after a closing one is an escaped quote, so the field carries on
+            quoted = true;
+        } else if (*c == '\n') {
+            return c;
+        }
+        field_start = *c == ',';
+        closed_quote = false;
+    }
+    return NULL;
+}
+
+ExecuteResult copy_from_csv(Table *table, int fd, CopyStats *stats) {
+    CopyBuffer *buffer = new_copy_buffer(fd);
+    CopyAppender appender = {table, 0, false, false};
+    ExecuteResult result = EXECUTE_SUCCESS;
+    Row row;
+
+    while (1) {
+        char *line = buffer->data + buffer->position;
+        size_t remaining = buffer->len - buffer->position;
+        char *newline = csv_record_end(line, remaining);
+
+        if (newline == NULL) {
+            if (!buffer->eof) {
+                if (buffer->position == 0 && buffer->len == COPY_BUFFER_SIZE) {
+                    printf("Error: CSV line longer than %d bytes\n", COPY_BUFFER_SIZE);
+                    result = EXECUTE_ERROR_IO;
+                    break;
+                }
+                if (!copy_buffer_fill(buffer)) {
+                    result = EXECUTE_ERROR_IO;
+                    break;
+                }
+                continue;
+            }
+            if (remaining == 0) {
+                break;
+            }
+            // Final line without a trailing newline
+            newline = line + remaining;
+        }
+
+        size_t line_len = newline - line;
+        buffer->position += line_len < remaining ? line_len + 1 : line_len;
+        if (line_len == 0) {
+            continue;
+        }
+
+        if (!parse_csv_line(line, line_len, &row)) {
+            stats->rows_skipped++;
+            continue;
+        }
+        // Duplicates are skipped like malformed rows, but a full table or failed write ends the copy
+        ExecuteResult insert_result = copy_insert(&appender, &row);
+        if (insert_result == EXECUTE_ERROR_DUPLICATE_KEY) {
+            stats->rows_skipped++;
+            continue;
+        }
+        if (insert_result != EXECUTE_SUCCESS) {
+            result = insert_result;
+            break;
+        }
+        stats->rows_copied++;
+    }
+
+    copy_appender_finish(&appender);
+    close_copy_buffer(buffer);
+    return result;
+}
+
+ExecuteResult copy_from_binary(Table *table, int fd, CopyStats *stats) {
+    CopyBuffer *buffer = new_copy_buffer(fd);
+    ExecuteResult result = EXECUTE_SUCCESS;
+    const size_t header_size = sizeof(COPY_BINARY_MAGIC) - 1 + sizeof(uint32_t);
+    // Largest possible encoded row: id, two length bytes and both columns
+    const size_t max_row_size = sizeof(uint32_t) + 2 + COLUMN_USERNAME_SIZE + COLUMN_EMAIL_SIZE;
+    CopyAppender appender = {table, 0, false, false};
+    Row row;
+
+    if (!copy_buffer_fill(buffer) || buffer->len < header_size ||
+        memcmp(buffer->data, COPY_BINARY_MAGIC, sizeof(COPY_BINARY_MAGIC) - 1) != 0) {
+        printf("Error: Not a touchstone binary copy file\n");
+        close_copy_buffer(buffer);
+        return EXECUTE_ERROR_IO;
+    }
+    uint32_t version;
+    memcpy(&version, buffer->data + sizeof(COPY_BINARY_MAGIC) - 1, sizeof(uint32_t));
+    if (version != COPY_BINARY_VERSION) {
+        printf("Error: Unsupported binary copy version %d\n", version);
+        close_copy_buffer(buffer);
+        return EXECUTE_ERROR_IO;
+    }
+    buffer->position = header_size;
+
+    while (1) {
+        if (buffer->len - buffer->position < max_row_size && !buffer->eof && !copy_buffer_fill(buffer)) {
+            result = EXECUTE_ERROR_IO;
+            break;
+        }
+
+        char *cursor = buffer->data + buffer->position;
+        size_t remaining = buffer->len - buffer->position;
+        if (remaining == 0) {
+            break;
+        }
+        if (remaining < sizeof(uint32_t) + 2) {
+            printf("Error: Truncated binary copy file\n");
+            result = EXECUTE_ERROR_IO;
+            break;
+        }
+
+        memcpy(&row.id, cursor, sizeof(uint32_t));
+        uint8_t username_len = cursor[sizeof(uint32_t)];
+        size_t email_len_offset = sizeof(uint32_t) + 1 + username_len;
+        if (remaining <= email_len_offset) {
+            printf("Error: Truncated binary copy file\n");
+            result = EXECUTE_ERROR_IO;
+            break;
+        }
+        uint8_t email_len = cursor[email_len_offset];
+        size_t row_size = email_len_offset + 1 + email_len;
+        if (remaining < row_size) {
+            printf("Error: Truncated binary copy file\n");
+            result = EXECUTE_ERROR_IO;
+            break;
+        }
+        buffer->position += row_size;
+
+        // Same id range as CSV and insert statements
+        if (username_len > COLUMN_USERNAME_SIZE || row.id > INT32_MAX) {
+            stats->rows_skipped++;
+            continue;
+        }
+        memcpy(row.username, cursor + sizeof(uint32_t) + 1, username_len);
+        row.username[username_len] = '\0';
+        memcpy(row.email, cursor + email_len_offset + 1, email_len);
+        row.email[email_len] = '\0';
+
+        ExecuteResult insert_result = copy_insert(&appender, &row);
+        if (insert_result == EXECUTE_ERROR_DUPLICATE_KEY) {
+            stats->rows_skipped++;
+            continue;
+        }
+        if (insert_result != EXECUTE_SUCCESS) {
+            result = insert_result;
+            break;
+        }
+        stats->rows_copied++;
+    }
+
+    copy_appender_finish(&appender);
+    close_copy_buffer(buffer);
+    return result;
+}
+
+size_t csv_quote_field(char *destination, const char *field, size_t max_len) {
+    // Fields holding a delimiter or quote are quoted with embedded quotes doubled, so parse_csv_line reads them back
+    size_t len = strnlen(field, max_len);
+    bool needs_quotes = false;
+    for (size_t i = 0; i < len; i++) {
+        if (field[i] == ',' || field[i] == '"' || field[i] == '\n' || field[i] == '\r') {
+            needs_quotes = true;
+            break;
+        }
+    }
+    if (!needs_quotes) {
+        memcpy(destination, field, len);
+        return len;
+    }
+
+    size_t position = 0;
+    destination[position++] = '"';
+    for (size_t i = 0; i < len; i++) {
+        if (field[i] == '"') {
+            destination[position++] = '"';
+        }
+        destination[position++] = field[i];
+    }
+    destination[position++] = '"';
+    return position;
+}
+
+ExecuteResult copy_to_csv(Table *table, int fd, CopyStats *stats) {
+    CopyBuffer *buffer = new_copy_buffer(fd);
+    ExecuteResult result = EXECUTE_SUCCESS;
+    Cursor *cursor = table_start(table);
+    Row row;
+    // Room for the id, both columns fully quoted with every character doubled, the delimiters and newline
+    char line[16 + 2 * (COLUMN_USERNAME_SIZE + COLUMN_EMAIL_SIZE) + 4];
+
+    while (!cursor->end_of_table) {
+        deserialize_row(cursor_ptr(cursor), &row);
+        size_t line_len = snprintf(line, sizeof(line), "%u,", row.id);
+        line_len += csv_quote_field(line + line_len, row.username, COLUMN_USERNAME_SIZE);
+        line[line_len++] = ',';
+        line_len += csv_quote_field(line + line_len, row.email, COLUMN_EMAIL_SIZE);
+        line[line_len++] = '\n';
+        if (!copy_buffer_write(buffer, line, line_len)) {
+            result = EXECUTE_ERROR_IO;
+            break;
+        }
+        stats->rows_copied++;
+        cursor_advance(cursor);
+    }
+
+    if (result == EXECUTE_SUCCESS && !copy_buffer_flush(buffer)) {
+        result = EXECUTE_ERROR_IO;
+    }
+    free(cursor);
+    close_copy_buffer(buffer);
+    return result;
+}
+
+ExecuteResult copy_to_binary(Table *table, int fd, CopyStats *stats) {
+    CopyBuffer *buffer = new_copy_buffer(fd);
+    ExecuteResult result = EXECUTE_SUCCESS;
+    Cursor *cursor = table_start(table);
+    uint32_t version = COPY_BINARY_VERSION;
+    Row row;
+
+    copy_buffer_write(buffer, COPY_BINARY_MAGIC, sizeof(COPY_BINARY_MAGIC) - 1);
+    copy_buffer_write(buffer, &version, sizeof(uint32_t));
+
+    while (!cursor->end_of_table) {
+        deserialize_row(cursor_ptr(cursor), &row);
+        uint8_t username_len = strnlen(row.username, COLUMN_USERNAME_SIZE);
+        uint8_t email_len = strnlen(row.email, COLUMN_EMAIL_SIZE);
+        if (!copy_buffer_write(buffer, &row.id, sizeof(uint32_t)) ||
+            !copy_buffer_write(buffer, &username_len, 1) ||
+            !copy_buffer_write(buffer, row.username, username_len) ||
+            !copy_buffer_write(buffer, &email_len, 1) ||
+            !copy_buffer_write(buffer, row.email, email_len)) {
+            result = EXECUTE_ERROR_IO;
+            break;
+        }
+        stats->rows_copied++;
+        cursor_advance(cursor);
+    }
+
+    if (result == EXECUTE_SUCCESS && !copy_buffer_flush(buffer)) {
+        result = EXECUTE_ERROR_IO;
+    }
+    free(cursor);
+    close_copy_buffer(buffer);
+    return result;
+}
+
+ExecuteResult execute_copy(Statement *statement, Table *table) {
+    CopySpec *copy = &statement->copy;
+    int fd;
+    if (copy->direction == COPY_FROM) {
+        fd = open(copy->filename, O_RDONLY);
+    } else {
+        fd = open(copy->filename, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    }
+    if (fd == -1) {
+        printf("Error: Unable to open copy file '%s': %d\n", copy->filename, errno);
+        return EXECUTE_ERROR_IO;
+    }
+
+    CopyStats stats = {0};
+    ExecuteResult result;
+    switch (copy->direction) {
+        case COPY_FROM:
+            result = copy->format == COPY_FORMAT_CSV ? copy_from_csv(table, fd, &stats)
+                                                     : copy_from_binary(table, fd, &stats);
+            break;
+        case COPY_TO:
+            result = copy->format == COPY_FORMAT_CSV ? copy_to_csv(table, fd, &stats)
+                                                     : copy_to_binary(table, fd, &stats);
+            break;
+    }
+    close(fd);
+
+    printf("Copied %d rows", stats.rows_copied);
+    if (stats.rows_skipped > 0) {
+        printf(", skipped %d", stats.rows_skipped);
+    }
+    printf("\n");
+    return result;
+}
@@ -0,0 +1,45 @@
+//
+// Created by Matthew Emerson on 2/6/22.
+//
+
+#ifndef TOUCHSTONE_COPY_H
+#define TOUCHSTONE_COPY_H
+
+#include "db.h"
+
+#define COPY_BUFFER_SIZE        (1 << 16)
+#define COPY_BINARY_MAGIC       "TSTB"
+#define COPY_BINARY_VERSION     1
+
+typedef struct {
+    int fd;
+    char *data;
+    size_t len;
+    size_t position;
+    bool eof;
+} CopyBuffer;
+
+// Rightmost leaf of a B-tree that COPY FROM fills directly while keys arrive in ascending order
+typedef struct {
+    Table *table;
+    uint32_t page_num;
+    bool found;
+    // Cells were appended since the leaf was last marked dirty
+    bool changed;
+} CopyAppender;
+
+typedef struct {
+    uint32_t rows_copied;
+    uint32_t rows_skipped;
+} CopyStats;
+
+ExecuteResult execute_copy(Statement *statement, Table *table);
+
+void copy_appender_finish(CopyAppender *appender);
+ExecuteResult copy_insert(CopyAppender *appender, Row *row);
+ExecuteResult copy_from_csv(Table *table, int fd, CopyStats *stats);
+ExecuteResult copy_from_binary(Table *table, int fd, CopyStats *stats);
+ExecuteResult copy_to_csv(Table *table, int fd, CopyStats *stats);
+ExecuteResult copy_to_binary(Table *table, int fd, CopyStats *stats);
+
+#endif //TOUCHSTONE_COPY_H
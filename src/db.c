@@ -8,6 +8,12 @@
 #include <unistd.h>
 #include <errno.h>
 #include "db.h"
+#include "copy.h"
+#include "sort.h"
+#include "learned.h"
+#include "hash.h"
+#include "trace.h"
+#include "journal.h"
 
 // Row schema
 const uint32_t ID_SIZE = size_of_attribute(Row, id);
@@ -18,8 +24,16 @@ const uint32_t ID_OFFSET = 0;
 const uint32_t USERNAME_OFFSET = ID_OFFSET + ID_SIZE;
 const uint32_t EMAIL_OFFSET = USERNAME_OFFSET + USERNAME_SIZE;
 
-// Page
-const uint32_t PAGE_SIZE = 4096;
+// File header
+const char FILE_HEADER_MAGIC[] = "touchstone db";
+const uint32_t FILE_HEADER_MAGIC_SIZE = 16;
+const uint32_t FILE_HEADER_VERSION_OFFSET = FILE_HEADER_MAGIC_SIZE;
+const uint32_t FILE_HEADER_PAGE_SIZE_OFFSET = FILE_HEADER_VERSION_OFFSET + sizeof(uint32_t);
+// Zero, and so a B-tree, in files written before hash tables existed
+const uint32_t FILE_HEADER_TABLE_TYPE_OFFSET = FILE_HEADER_PAGE_SIZE_OFFSET + sizeof(uint32_t);
+// B-tree root as of the last commit; zero unless a copy-on-write session left it elsewhere
+const uint32_t FILE_HEADER_ROOT_PAGE_OFFSET = FILE_HEADER_TABLE_TYPE_OFFSET + sizeof(uint32_t);
+const uint32_t FILE_FORMAT_VERSION = 1;
 
 // Common node header
 const uint32_t NODE_TYPE_SIZE = sizeof(uint8_t);
@@ -43,12 +57,6 @@ const uint32_t LEAF_NODE_KEY_OFFSET = 0;
 const uint32_t LEAF_NODE_VALUE_SIZE = ROW_SIZE;
 const uint32_t LEAF_NODE_VALUE_OFFSET = LEAF_NODE_KEY_OFFSET + LEAF_NODE_KEY_SIZE;
 const uint32_t LEAF_NODE_CELL_SIZE = LEAF_NODE_KEY_SIZE + LEAF_NODE_VALUE_SIZE;
-const uint32_t LEAF_NODE_BODY_SIZE = PAGE_SIZE - LEAF_NODE_HEADER_SIZE;
-const uint32_t LEAF_NODE_MAX_CELLS = LEAF_NODE_BODY_SIZE / LEAF_NODE_CELL_SIZE;
-
-// Leaf node misc
-const uint32_t LEAF_NODE_RIGHT_SPLIT_COUNT = (LEAF_NODE_MAX_CELLS + 1) / 2;
-const uint32_t LEAF_NODE_LEFT_SPLIT_COUNT = (LEAF_NODE_MAX_CELLS + 1) - LEAF_NODE_RIGHT_SPLIT_COUNT;
 
 // Internal node header
 const uint32_t INTERNAL_NODE_NUM_KEYS_SIZE = sizeof(uint32_t);
@@ -65,15 +73,29 @@ const uint32_t INTERNAL_NODE_CELL_SIZE = INTERNAL_NODE_CHILD_SIZE + INTERNAL_NOD
 const uint32_t INTERNAL_NODE_MAX_CELLS = 3;
 
 
-void print_constants() {
+bool pager_set_page_size(Pager *pager, uint32_t page_size) {
+    // Each open file keeps its own layout, so files with different page sizes can be open at once
+    if (page_size < MIN_PAGE_SIZE || page_size > MAX_PAGE_SIZE || (page_size & (page_size - 1)) != 0) {
+        return false;
+    }
+
+    pager->page_size = page_size;
+    pager->leaf_node_max_cells = (page_size - LEAF_NODE_HEADER_SIZE) / LEAF_NODE_CELL_SIZE;
+    pager->leaf_node_right_split_count = (pager->leaf_node_max_cells + 1) / 2;
+    pager->leaf_node_left_split_count = (pager->leaf_node_max_cells + 1) - pager->leaf_node_right_split_count;
+    return true;
+}
+
+void print_constants(Pager *pager) {
+    printf("PAGE_SIZE: %d\n", pager->page_size);
     printf("ROW_SIZE: %d\n", ROW_SIZE);
     printf("COMMON_NODE_HEADER_SIZE: %d\n", COMMON_NODE_HEADER_SIZE);
     printf("LEAF_NODE_HEADER_SIZE: %d\n", LEAF_NODE_HEADER_SIZE);
     printf("LEAF_NODE_CELL_SIZE: %d\n", LEAF_NODE_CELL_SIZE);
-    printf("LEAF_NODE_BODY_SIZE: %d\n", LEAF_NODE_BODY_SIZE);
-    printf("LEAF_NODE_MAX_CELLS: %d\n", LEAF_NODE_MAX_CELLS);
-    printf("LEAF_NODE_LEFT_SPLIT_COUNT: %d\n", LEAF_NODE_LEFT_SPLIT_COUNT);
-    printf("LEAF_NODE_RIGHT_SPLIT_COUNT: %d\n", LEAF_NODE_RIGHT_SPLIT_COUNT);
+    printf("LEAF_NODE_BODY_SIZE: %d\n", pager->page_size - LEAF_NODE_HEADER_SIZE);
+    printf("LEAF_NODE_MAX_CELLS: %d\n", pager->leaf_node_max_cells);
+    printf("LEAF_NODE_LEFT_SPLIT_COUNT: %d\n", pager->leaf_node_left_split_count);
+    printf("LEAF_NODE_RIGHT_SPLIT_COUNT: %d\n", pager->leaf_node_right_split_count);
 }
 
 void indent(uint32_t level) {
@@ -135,24 +157,21 @@ void deserialize_row(void *source, Row *destination) {
 }
 
 void *get_page(Pager *pager, uint32_t page_num) {
-    if (page_num > TABLE_MAX_PAGES) {
+    if (page_num >= TABLE_MAX_PAGES) {
         printf("Error: Page out of bounds: %d of %d\n", page_num, TABLE_MAX_PAGES);
         exit(EXIT_FAILURE);
     }
 
+    trace_page(pager, page_num, TRACE_GET_PAGE, pager->pages[page_num] != NULL);
+
     if (pager->pages[page_num] == NULL) {
         // Cache miss, read page from disk
-        void *page = malloc(PAGE_SIZE);
-        uint32_t num_pages = pager->file_len / PAGE_SIZE;
+        void *page = malloc(pager->page_size);
+        uint32_t num_pages = (pager->file_len - pager->header_size) / pager->page_size;
 
-        // Account for a possible partial page at the end of the file
-        if (pager->file_len % PAGE_SIZE) {
-            num_pages += 1;
-        }
-
-        if (page_num <= num_pages) {
-            lseek(pager->fd, page_num * PAGE_SIZE, SEEK_SET);
-            ssize_t bytes_read = read(pager->fd, page, PAGE_SIZE);
+        // Pages released by a truncate stay on disk until the next commit, but are not read back
+        if (page_num < num_pages && page_num < pager->num_pages) {
+            ssize_t bytes_read = pread(pager->fd, page, pager->page_size, pager_page_offset(pager, page_num));
             if (bytes_read == -1) {
                 printf("Error: Error reading DB file: %d", errno);
                 exit(EXIT_FAILURE);
@@ -174,28 +193,140 @@ void pager_flush(Pager *pager, uint32_t page_num) {
         printf("Error: Tried to flush null page\n");
         exit(EXIT_FAILURE);
     }
+    trace_page(pager, page_num, TRACE_FLUSH, true);
 
-    off_t offset = lseek(pager->fd, page_num * PAGE_SIZE, SEEK_SET);
-    if (offset == -1) {
-        printf("Error: Unable to seek to page %d: %d\n", page_num, errno);
+    ssize_t bytes_written = pwrite(pager->fd, pager->pages[page_num], pager->page_size,
+                                   pager_page_offset(pager, page_num));
+    if (bytes_written == -1) {
+        printf("Error: Unable to write page %d: %d", page_num, errno);
         exit(EXIT_FAILURE);
     }
 
-    ssize_t bytes_written = write(pager->fd, pager->pages[page_num], PAGE_SIZE);
-    if (bytes_written == -1) {
-        printf("Error: Unable to write page %d: %d", page_num, errno);
+    off_t end = pager_page_offset(pager, page_num + 1);
+    if (end > pager->file_len) {
+        pager->file_len = end;
+    }
+}
+
+void pager_truncate(Pager *pager, uint32_t num_pages) {
+    // The file itself is cut at the next commit, so the released pages can still be rolled back
+    for (uint32_t i = num_pages; i < TABLE_MAX_PAGES; i++) {
+        free(pager->pages[i]);
+        pager->pages[i] = NULL;
+    }
+    pager->num_pages = num_pages;
+
+    uint32_t kept = 0;
+    for (uint32_t i = 0; i < pager->num_free_pages; i++) {
+        if (pager->free_pages[i] < num_pages) {
+            pager->free_pages[kept] = pager->free_pages[i];
+            pager->free_page_versions[kept] = pager->free_page_versions[i];
+            kept++;
+        }
+    }
+    pager->num_free_pages = kept;
+}
+
+off_t pager_page_offset(Pager *pager, uint32_t page_num) {
+    // TABLE_MAX_PAGES keeps files under 7 MB today; off_t only matters once that cap is lifted
+    return pager->header_size + (off_t) page_num * pager->page_size;
+}
+
+void pager_mark_dirty(Pager *pager, uint32_t page_num) {
+    // Stamp the page so backup and replication can tell what changed since they last looked
+    pager->change_counter++;
+    pager->page_changed_at[page_num] = pager->change_counter;
+}
+
+void pager_commit(Pager *pager) {
+    // Pages changed since the last commit reach the file together or not at all, through a rollback journal
+    uint32_t page_nums[TABLE_MAX_PAGES];
+    uint32_t num_dirty = 0;
+    for (uint32_t i = 0; i < pager->num_pages; i++) {
+        if (pager->pages[i] != NULL && pager->page_changed_at[i] > pager->committed_counter) {
+            page_nums[num_dirty++] = i;
+        }
+    }
+    off_t file_len = pager_page_offset(pager, pager->num_pages);
+    bool root_changed = pager->header_size > 0 && pager->root_page_num != pager->committed_root_page_num;
+    if (num_dirty == 0 && file_len == pager->file_len && !root_changed) {
+        return;
+    }
+
+    // Pages cut off the end of the file are saved too, since the old tree may still point at them
+    uint32_t num_saved = num_dirty;
+    for (uint32_t i = pager->num_pages; i < TABLE_MAX_PAGES && pager_page_offset(pager, i) < pager->file_len; i++) {
+        page_nums[num_saved++] = i;
+    }
+    if (!journal_write(pager, page_nums, num_saved, root_changed)) {
+        exit(EXIT_FAILURE);
+    }
+
+    for (uint32_t i = 0; i < num_dirty; i++) {
+        pager_flush(pager, page_nums[i]);
+    }
+    if (root_changed && pwrite(pager->fd, &pager->root_page_num, sizeof(uint32_t), FILE_HEADER_ROOT_PAGE_OFFSET) !=
+                        sizeof(uint32_t)) {
+        printf("Error: Unable to write DB file header: %d\n", errno);
+        exit(EXIT_FAILURE);
+    }
+    if (file_len != pager->file_len && ftruncate(pager->fd, file_len) == -1) {
+        printf("Error: Unable to truncate DB file: %d\n", errno);
         exit(EXIT_FAILURE);
     }
+    pager->file_len = file_len;
+    if (fsync(pager->fd) == -1) {
+        printf("Error: Unable to sync DB file: %d\n", errno);
+        exit(EXIT_FAILURE);
+    }
+    journal_remove(pager);
+    pager->committed_counter = pager->change_counter;
+    pager->committed_root_page_num = pager->root_page_num;
+}
+
+void pager_free_page(Pager *pager, uint32_t page_num, uint32_t version) {
+    // version is the first tree version that no longer reaches the page; page 0 is kept for relink_tree()
+    if (page_num == 0) {
+        return;
+    }
+    pager->free_pages[pager->num_free_pages] = page_num;
+    pager->free_page_versions[pager->num_free_pages] = version;
+    pager->num_free_pages++;
+}
+
+uint32_t pager_available_pages(Pager *pager) {
+    uint32_t available = TABLE_MAX_PAGES - pager->num_pages;
+    for (uint32_t i = 0; i < pager->num_free_pages; i++) {
+        if (pager->free_page_versions[i] <= pager->oldest_pinned_version) {
+            available++;
+        }
+    }
+    return available;
 }
 
 uint32_t get_unused_page_num(Pager *pager) {
-    // TODO: recycling of pages
+    // Reuse a freed page once every pinned snapshot is at least as new as the version that freed it
+    for (uint32_t i = 0; i < pager->num_free_pages; i++) {
+        if (pager->free_page_versions[i] <= pager->oldest_pinned_version) {
+            uint32_t page_num = pager->free_pages[i];
+            pager->num_free_pages--;
+            pager->free_pages[i] = pager->free_pages[pager->num_free_pages];
+            pager->free_page_versions[i] = pager->free_page_versions[pager->num_free_pages];
+            return page_num;
+        }
+    }
     return pager->num_pages;
 }
 
-ExecuteResult execute_insert(Statement *statement, Table *table) {
-    Row *row_to_insert = &statement->row_to_insert;
-    uint32_t key = row_to_insert->id;
+ExecuteResult table_insert(Table *table, Row *row) {
+    if (table->pager->type == TABLE_HASH) {
+        return hash_insert(table, row);
+    }
+    if (table->copy_on_write) {
+        return cow_insert(table, row);
+    }
+
+    uint32_t key = row->id;
     Cursor *cursor = table_find(table, key);
 
     void *node = get_page(table->pager, cursor->page_num);
@@ -203,23 +334,166 @@ ExecuteResult execute_insert(Statement *statement, Table *table) {
     if (cursor->cell_num < num_cells) {
         uint32_t key_at_index = *leaf_node_key(node, cursor->cell_num);
         if (key_at_index == key) {
+            free(cursor);
             return EXECUTE_ERROR_DUPLICATE_KEY;
         }
     }
+    // A split takes a new leaf, plus a new left child when the root splits
+    if (num_cells >= table->pager->leaf_node_max_cells && pager_available_pages(table->pager) < 2) {
+        free(cursor);
+        return EXECUTE_ERROR_TABLE_FULL;
+    }
+
+    leaf_node_insert(cursor, key, row);
+    free(cursor);
+
+    return EXECUTE_SUCCESS;
+}
+
+ExecuteResult cow_insert(Table *table, Row *row) {
+    Pager *pager = table->pager;
+    uint32_t key = row->id;
+
+    // Record the root-to-leaf path
+    uint32_t path[BTREE_MAX_DEPTH];
+    uint32_t depth = 0;
+    uint32_t page_num = table->root_page_num;
+    void *node = get_page(pager, page_num);
+    while (get_node_type(node) == INTERNAL_NODE) {
+        if (depth == BTREE_MAX_DEPTH - 1) {
+            printf("Error: Tree deeper than %d levels\n", BTREE_MAX_DEPTH);
+            exit(EXIT_FAILURE);
+        }
+        path[depth++] = page_num;
+        page_num = *internal_node_child(node, internal_node_find_child(node, key));
+        node = get_page(pager, page_num);
+    }
+    path[depth++] = page_num;
 
-    leaf_node_insert(cursor, row_to_insert->id, row_to_insert);
+    Cursor *cursor = leaf_node_find(table, page_num, key);
+    if (cursor->cell_num < *leaf_node_num_cells(node) && *leaf_node_key(node, cursor->cell_num) == key) {
+        free(cursor);
+        return EXECUTE_ERROR_DUPLICATE_KEY;
+    }
+    // One page per copied node, then up to two more if the leaf and the root split
+    if (pager_available_pages(pager) < depth + 2) {
+        free(cursor);
+        return EXECUTE_ERROR_TABLE_FULL;
+    }
+
+    // Copy the path to fresh pages so published pages are never modified
+    uint32_t copy_page_num = 0;
+    for (uint32_t i = 0; i < depth; i++) {
+        uint32_t parent_copy_page_num = copy_page_num;
+        copy_page_num = get_unused_page_num(pager);
+        void *copy = get_page(pager, copy_page_num);
+        memcpy(copy, get_page(pager, path[i]), pager->page_size);
+        pager_mark_dirty(pager, copy_page_num);
+
+        if (i == 0) {
+            table->root_page_num = copy_page_num;
+        } else {
+            void *parent_copy = get_page(pager, parent_copy_page_num);
+            *internal_node_child(parent_copy, internal_node_find_child(parent_copy, key)) = copy_page_num;
+            *node_parent(copy) = parent_copy_page_num;
+        }
+    }
+
+    cursor->root_page_num = table->root_page_num;
+    cursor->page_num = copy_page_num;
+    leaf_node_insert(cursor, key, row);
     free(cursor);
 
+    // The old path is only reachable from snapshots older than the version published here
+    publish_root(table);
+    uint32_t version = (uint32_t) (atomic_load_explicit(&table->published_root, memory_order_relaxed) >> 32);
+    for (uint32_t i = 0; i < depth; i++) {
+        pager_free_page(pager, path[i], version);
+    }
     return EXECUTE_SUCCESS;
 }
 
+ExecuteResult table_delete(Table *table, uint32_t key) {
+    // Only hash tables support deletes; B-tree leaves are never merged or emptied
+    if (table->pager->type != TABLE_HASH) {
+        return EXECUTE_ERROR_UNSUPPORTED;
+    }
+    return hash_delete(table, key);
+}
+
+LearnedIndex *table_learned_index(Table *table) {
+    // Copy-on-write moves leaves on every insert, so the model is only kept for in-place tables
+    if (table->copy_on_write) {
+        return NULL;
+    }
+    return table->learned_index;
+}
+
+bool table_lookup(Table *table, uint32_t key, Row *row) {
+    if (table->pager->type == TABLE_HASH) {
+        return hash_lookup(table, key, row);
+    }
+
+    Cursor *cursor = NULL;
+    LearnedIndex *learned_index = table_learned_index(table);
+    if (learned_index != NULL) {
+        cursor = learned_index_find(learned_index, table, key);
+    }
+    if (cursor == NULL) {
+        cursor = table_find(table, key);
+    }
+
+    void *node = get_page(table->pager, cursor->page_num);
+    bool found = cursor->cell_num < *leaf_node_num_cells(node) && *leaf_node_key(node, cursor->cell_num) == key;
+    if (found) {
+        deserialize_row(leaf_node_value(node, cursor->cell_num), row);
+    }
+    free(cursor);
+    return found;
+}
+
+ExecuteResult execute_insert(Statement *statement, Table *table) {
+    return table_insert(table, &statement->row_to_insert);
+}
+
 ExecuteResult execute_select(Statement *statement, Table *table) {
-    Cursor *cursor = table_start(table);
+    SelectSpec *select = &statement->select;
     Row row;
-    while (!cursor->end_of_table) {
+
+    if (select->point) {
+        if (table_lookup(table, select->key, &row)) {
+            print_row(&row);
+            printf("\n");
+        }
+        return EXECUTE_SUCCESS;
+    }
+
+    Cursor *cursor = table_start(table);
+
+    if (select->ordered) {
+        Sorter *sorter = new_sorter(select->order_column, select->descending, select->limit,
+                                    table->sort_memory_budget);
+        while (!cursor->end_of_table) {
+            deserialize_row(cursor_ptr(cursor), &row);
+            sorter_add(sorter, &row);
+            cursor_advance(cursor);
+        }
+        sorter_finish(sorter);
+        while (sorter_next(sorter, &row)) {
+            print_row(&row);
+            printf("\n");
+        }
+        close_sorter(sorter);
+        free(cursor);
+        return EXECUTE_SUCCESS;
+    }
+
+    uint32_t rows_printed = 0;
+    while (!cursor->end_of_table && (select->limit == 0 || rows_printed < select->limit)) {
         deserialize_row(cursor_ptr(cursor), &row);
         print_row(&row);
         printf("\n");
+        rows_printed++;
         cursor_advance(cursor);
     }
     free(cursor);
@@ -232,47 +506,141 @@ ExecuteResult execute_statement(Statement *statement, Table *table) {
             return execute_insert(statement, table);
         case STATEMENT_SELECT:
             return execute_select(statement, table);
+        case STATEMENT_COPY:
+            return execute_copy(statement, table);
+        case STATEMENT_DELETE:
+            return table_delete(table, statement->key_to_delete);
     }
 }
 
-Pager *open_pager(const char *filename) {
+Pager *open_pager(const char *filename, uint32_t page_size, TableType type) {
     int fd = open(filename, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
 
     if (fd == -1) {
         printf("Unable to open DB file\n");
-        exit(EXIT_FAILURE);
+        return NULL;
     }
 
-    off_t file_len = lseek(fd, 0, SEEK_END);
-
     Pager *pager = malloc(sizeof(Pager));
+    if (pager == NULL) {
+        close(fd);
+        return NULL;
+    }
     pager->fd = fd;
+    journal_path(pager->journal_path, filename);
+    // A journal left behind means the last commit never finished, so undo its partial writes first
+    if (!journal_recover(fd, pager->journal_path)) {
+        close(fd);
+        free(pager);
+        return NULL;
+    }
+
+    off_t file_len = lseek(fd, 0, SEEK_END);
+    pager->header_size = FILE_HEADER_SIZE;
+
+    char header[FILE_HEADER_SIZE];
+    uint32_t root_page_num = 0;
+    if (file_len == 0) {
+        // New file: record the page size so later opens lay nodes out the same way
+        if (page_size == 0) {
+            page_size = DEFAULT_PAGE_SIZE;
+        }
+        memset(header, 0, FILE_HEADER_SIZE);
+        memcpy(header, FILE_HEADER_MAGIC, sizeof(FILE_HEADER_MAGIC));
+        memcpy(header + FILE_HEADER_VERSION_OFFSET, &FILE_FORMAT_VERSION, sizeof(uint32_t));
+        memcpy(header + FILE_HEADER_PAGE_SIZE_OFFSET, &page_size, sizeof(uint32_t));
+        memcpy(header + FILE_HEADER_TABLE_TYPE_OFFSET, &type, sizeof(uint32_t));
+        if (pwrite(fd, header, FILE_HEADER_SIZE, 0) != FILE_HEADER_SIZE) {
+            printf("Error: Unable to write DB file header: %d\n", errno);
+            close(fd);
+            free(pager);
+            return NULL;
+        }
+        file_len = FILE_HEADER_SIZE;
+    } else if (file_len >= FILE_HEADER_SIZE && pread(fd, header, FILE_HEADER_SIZE, 0) == FILE_HEADER_SIZE &&
+               memcmp(header, FILE_HEADER_MAGIC, sizeof(FILE_HEADER_MAGIC)) == 0) {
+        memcpy(&page_size, header + FILE_HEADER_PAGE_SIZE_OFFSET, sizeof(uint32_t));
+        memcpy(&type, header + FILE_HEADER_TABLE_TYPE_OFFSET, sizeof(uint32_t));
+        memcpy(&root_page_num, header + FILE_HEADER_ROOT_PAGE_OFFSET, sizeof(uint32_t));
+    } else {
+        // Files written before the header existed are headerless 4 KB B-trees
+        pager->header_size = 0;
+        page_size = DEFAULT_PAGE_SIZE;
+        type = TABLE_BTREE;
+    }
+
+    if (!pager_set_page_size(pager, page_size)) {
+        printf("Error: Unsupported page size %d\n", page_size);
+        close(fd);
+        free(pager);
+        return NULL;
+    }
+
+    pager->type = type;
     pager->file_len = file_len;
-    pager->num_pages = (file_len / PAGE_SIZE);
+    pager->num_pages = (file_len - pager->header_size) / pager->page_size;
 
-    if (file_len % PAGE_SIZE != 0) {
-        printf("Error: corrupt db file (partial page detected)");
-        exit(EXIT_FAILURE);
+    if ((file_len - pager->header_size) % pager->page_size != 0) {
+        printf("Error: corrupt db file (partial page detected)\n");
+        close(fd);
+        free(pager);
+        return NULL;
     }
 
     for (uint32_t i = 0; i < TABLE_MAX_PAGES; i++) {
         pager->pages[i] = NULL;
+        pager->page_changed_at[i] = 0;
     }
+    pager->change_counter = 0;
+    pager->committed_counter = 0;
+    pager->root_page_num = root_page_num;
+    pager->committed_root_page_num = root_page_num;
+    pager->num_free_pages = 0;
+    pager->oldest_pinned_version = UINT32_MAX;
+    pager->tracer = NULL;
+    pager->trace_source = 0;
 
     return pager;
 }
 
-Table *open_db(const char *filename) {
-    Pager *pager = open_pager(filename);
+Table *open_db(const char *filename, uint32_t page_size, TableType type) {
+    // page_size and type only apply when the file is created
+    // NULL if the file cannot be opened or is not a usable database
+    Pager *pager = open_pager(filename, page_size, type);
+    if (pager == NULL) {
+        return NULL;
+    }
 
     Table *table = malloc(sizeof(Table));
+    if (table == NULL) {
+        close(pager->fd);
+        free(pager);
+        return NULL;
+    }
     table->pager = pager;
     table->root_page_num = 0;
-
-    if (pager->num_pages == 0) {
+    table->published_root = 0;
+    table->copy_on_write = false;
+    table->num_pinned = 0;
+    table->sort_memory_budget = SORT_DEFAULT_MEMORY_BUDGET;
+    table->learned_index = NULL;
+    pthread_mutex_init(&table->mutex, NULL);
+
+    if (pager->num_pages == 0 && pager->type == TABLE_HASH) {
+        initialize_hash_table(pager);
+    } else if (pager->num_pages == 0) {
         void *root_node = get_page(pager, 0);
         initialize_leaf_node(root_node);
         set_node_root(root_node, true);
+        pager_mark_dirty(pager, 0);
+    } else if (pager->type == TABLE_BTREE) {
+        // A copy-on-write session that committed without closing left its root in the header
+        if (pager->root_page_num != 0) {
+            table->root_page_num = pager->root_page_num;
+            relink_tree(table);
+            pager->root_page_num = 0;
+        }
+        table_free_unreachable(table);
     }
 
     return table;
@@ -281,14 +649,11 @@ Table *open_db(const char *filename) {
 void close_db(Table *table) {
     Pager *pager = table->pager;
 
-    for (uint32_t i = 0; i < pager->num_pages; i++) {
-        if (pager->pages[i] == NULL) {
-            continue;
-        }
-        pager_flush(pager, i);
-        free(pager->pages[i]);
-        pager->pages[i] = NULL;
+    if (table->copy_on_write) {
+        relink_tree(table);
     }
+    pager->root_page_num = table->root_page_num;
+    pager_commit(pager);
 
     int result = close(pager->fd);
     if (result == -1) {
@@ -304,11 +669,156 @@ void close_db(Table *table) {
         }
     }
     free(pager);
+    free(table->learned_index);
+    pthread_mutex_destroy(&table->mutex);
     free(table);
 }
 
+void commit_db(Table *table) {
+    // Write the pages changed since the last commit atomically while keeping the cache warm
+    table->pager->root_page_num = table->root_page_num;
+    pager_commit(table->pager);
+}
+
+void table_lock(Table *table) {
+    pthread_mutex_lock(&table->mutex);
+}
+
+void table_unlock(Table *table) {
+    pthread_mutex_unlock(&table->mutex);
+}
+
+void publish_root(Table *table) {
+    uint64_t version = (atomic_load_explicit(&table->published_root, memory_order_relaxed) >> 32) + 1;
+    atomic_store_explicit(&table->published_root, (version << 32) | table->root_page_num, memory_order_release);
+}
+
+Snapshot table_snapshot(Table *table) {
+    uint64_t published = atomic_load_explicit(&table->published_root, memory_order_acquire);
+    Snapshot snapshot;
+    snapshot.table = table;
+    snapshot.root_page_num = (uint32_t) published;
+    snapshot.version = (uint32_t) (published >> 32);
+    return snapshot;
+}
+
+bool table_pin_snapshot(Table *table, Snapshot *snapshot) {
+    // Pages freed after the pinned version stay allocated until the snapshot is released
+    if (table->num_pinned == TABLE_MAX_SNAPSHOTS) {
+        return false;
+    }
+    *snapshot = table_snapshot(table);
+    table->pinned_versions[table->num_pinned++] = snapshot->version;
+    if (snapshot->version < table->pager->oldest_pinned_version) {
+        table->pager->oldest_pinned_version = snapshot->version;
+    }
+    return true;
+}
+
+void table_release_snapshot(Table *table, Snapshot *snapshot) {
+    uint32_t oldest = UINT32_MAX;
+    bool released = false;
+    uint32_t kept = 0;
+    for (uint32_t i = 0; i < table->num_pinned; i++) {
+        if (!released && table->pinned_versions[i] == snapshot->version) {
+            released = true;
+            continue;
+        }
+        table->pinned_versions[kept++] = table->pinned_versions[i];
+        if (table->pinned_versions[i] < oldest) {
+            oldest = table->pinned_versions[i];
+        }
+    }
+    table->num_pinned = kept;
+    table->pager->oldest_pinned_version = oldest;
+}
+
+void mark_reachable(Pager *pager, uint32_t page_num, bool *reachable) {
+    reachable[page_num] = true;
+    void *node = get_page(pager, page_num);
+    if (get_node_type(node) == INTERNAL_NODE) {
+        uint32_t num_keys = *internal_node_num_keys(node);
+        for (uint32_t i = 0; i <= num_keys; i++) {
+            mark_reachable(pager, *internal_node_child(node, i), reachable);
+        }
+    }
+}
+
+void table_free_unreachable(Table *table) {
+    // Pages copy-on-write replaced in earlier sessions are free once the file is reopened
+    Pager *pager = table->pager;
+    bool reachable[TABLE_MAX_PAGES] = {false};
+    mark_reachable(pager, table->root_page_num, reachable);
+    pager->num_free_pages = 0;
+    for (uint32_t i = 0; i < pager->num_pages; i++) {
+        if (!reachable[i]) {
+            pager_free_page(pager, i, 0);
+        }
+    }
+}
+
+Cursor *snapshot_start(Snapshot *snapshot) {
+    return tree_start(snapshot->table, snapshot->root_page_num);
+}
+
+Cursor *snapshot_find(Snapshot *snapshot, uint32_t key) {
+    return tree_find(snapshot->table, snapshot->root_page_num, key);
+}
+
+void relink_tree(Table *table) {
+    // Move the current root back to page 0 and repair the parent and sibling links that copying left stale
+    Pager *pager = table->pager;
+    if (table->root_page_num != 0) {
+        uint32_t old_root_page_num = table->root_page_num;
+        memcpy(get_page(pager, 0), get_page(pager, old_root_page_num), pager->page_size);
+        pager_mark_dirty(pager, 0);
+        table->root_page_num = 0;
+        publish_root(table);
+        pager_free_page(pager, old_root_page_num,
+                        (uint32_t) (atomic_load_explicit(&table->published_root, memory_order_relaxed) >> 32));
+    }
+
+    uint32_t previous_leaf = 0;
+    relink_subtree(pager, 0, 0, &previous_leaf);
+    *leaf_node_next_leaf(get_page(pager, previous_leaf)) = 0;
+}
+
+void relink_subtree(Pager *pager, uint32_t page_num, uint32_t parent_page_num, uint32_t *previous_leaf) {
+    void *node = get_page(pager, page_num);
+    *node_parent(node) = parent_page_num;
+    pager_mark_dirty(pager, page_num);
+
+    switch (get_node_type(node)) {
+        case INTERNAL_NODE: {
+            uint32_t num_keys = *internal_node_num_keys(node);
+            for (uint32_t i = 0; i <= num_keys; i++) {
+                relink_subtree(pager, *internal_node_child(node, i), page_num, previous_leaf);
+            }
+            break;
+        }
+        case LEAF_NODE:
+            if (*previous_leaf != 0) {
+                *leaf_node_next_leaf(get_page(pager, *previous_leaf)) = page_num;
+            }
+            *previous_leaf = page_num;
+            break;
+    }
+}
+
 Cursor *table_start(Table *table) {
-    Cursor *cursor = table_find(table, 0);
+    Cursor *cursor = table->pager->type == TABLE_HASH ? hash_start(table) : tree_start(table, table->root_page_num);
+    trace_page(table->pager, cursor->page_num, TRACE_CURSOR_START, true);
+    return cursor;
+}
+
+Cursor *table_find(Table *table, uint32_t key) {
+    Cursor *cursor = tree_find(table, table->root_page_num, key);
+    trace_page(table->pager, cursor->page_num, TRACE_CURSOR_FIND, true);
+    return cursor;
+}
+
+Cursor *tree_start(Table *table, uint32_t root_page_num) {
+    Cursor *cursor = tree_find(table, root_page_num, 0);
 
     void *node = get_page(table->pager, cursor->page_num);
     uint32_t num_cells = *leaf_node_num_cells(node);
@@ -317,29 +827,64 @@ Cursor *table_start(Table *table) {
     return cursor;
 }
 
-Cursor *table_find(Table *table, uint32_t key) {
-    uint32_t root_page_num = table->root_page_num;
+Cursor *tree_find(Table *table, uint32_t root_page_num, uint32_t key) {
     void *root_node = get_page(table->pager, root_page_num);
 
+    Cursor *cursor;
     if (get_node_type(root_node) == LEAF_NODE) {
-        return leaf_node_find(table, root_page_num, key);
+        cursor = leaf_node_find(table, root_page_num, key);
     } else {
-        return internal_node_find(table, root_page_num, key);
+        cursor = internal_node_find(table, root_page_num, key);
     }
+    cursor->root_page_num = root_page_num;
+    cursor->end_of_table = false;
+    return cursor;
 }
 
 void *cursor_ptr(Cursor *cursor) {
+    if (cursor->table->pager->type == TABLE_HASH) {
+        return hash_cursor_value(cursor);
+    }
     uint32_t page_num = cursor->page_num;
     void *page = get_page(cursor->table->pager, page_num);
     return leaf_node_value(page, cursor->cell_num);
 }
 
+uint32_t cursor_key(Cursor *cursor) {
+    if (cursor->table->pager->type == TABLE_HASH) {
+        return hash_cursor_key(cursor);
+    }
+    void *page = get_page(cursor->table->pager, cursor->page_num);
+    return *leaf_node_key(page, cursor->cell_num);
+}
+
 void cursor_advance(Cursor *cursor) {
+    trace_page(cursor->table->pager, cursor->page_num, TRACE_CURSOR_ADVANCE, true);
+    if (cursor->table->pager->type == TABLE_HASH) {
+        hash_cursor_advance(cursor);
+        return;
+    }
     uint32_t page_num = cursor->page_num;
     void *node = get_page(cursor->table->pager, page_num);
 
     cursor->cell_num += 1;
-    if (cursor->cell_num >= *leaf_node_num_cells(node)) {
+    if (cursor->cell_num >= *leaf_node_num_cells(node) && cursor->table->copy_on_write) {
+        // Copied leaves leave stale sibling links behind, so find the next leaf from the root
+        uint32_t last_key = *leaf_node_key(node, cursor->cell_num - 1);
+        if (last_key == UINT32_MAX) {
+            cursor->end_of_table = true;
+            return;
+        }
+        Cursor *next = tree_find(cursor->table, cursor->root_page_num, last_key + 1);
+        void *next_node = get_page(cursor->table->pager, next->page_num);
+        if (next->cell_num >= *leaf_node_num_cells(next_node)) {
+            cursor->end_of_table = true;
+        } else {
+            cursor->page_num = next->page_num;
+            cursor->cell_num = next->cell_num;
+        }
+        free(next);
+    } else if (cursor->cell_num >= *leaf_node_num_cells(node)) {
         uint32_t next_page_num = *leaf_node_next_leaf(node);
         if (next_page_num == 0) {
             cursor->end_of_table = true;
@@ -366,7 +911,7 @@ void create_new_root(Table *table, uint32_t right_child_page_num) {
     uint32_t left_child_page_num = get_unused_page_num(table->pager);
     void *left_child = get_page(table->pager, left_child_page_num);
 
-    memcpy(left_child, root, PAGE_SIZE);
+    memcpy(left_child, root, table->pager->page_size);
     set_node_root(left_child, false);
 
     initialize_internal_node(root);
@@ -378,6 +923,9 @@ void create_new_root(Table *table, uint32_t right_child_page_num) {
     *internal_node_right_child(root) = right_child_page_num;
     *node_parent(left_child) = table->root_page_num;
     *node_parent(right_child) = table->root_page_num;
+    pager_mark_dirty(table->pager, table->root_page_num);
+    pager_mark_dirty(table->pager, left_child_page_num);
+    pager_mark_dirty(table->pager, right_child_page_num);
 }
 
 uint32_t get_node_max_key(void *node) {
@@ -430,7 +978,7 @@ void leaf_node_insert(Cursor *cursor, uint32_t key, Row *value) {
     void *node = get_page(cursor->table->pager, cursor->page_num);
 
     uint32_t num_cells = *leaf_node_num_cells(node);
-    if (num_cells >= LEAF_NODE_MAX_CELLS) {
+    if (num_cells >= cursor->table->pager->leaf_node_max_cells) {
         // Node full
         leaf_node_split_and_insert(cursor, key, value);
         return;
@@ -446,6 +994,12 @@ void leaf_node_insert(Cursor *cursor, uint32_t key, Row *value) {
     *leaf_node_num_cells(node) += 1;
     *leaf_node_key(node, cursor->cell_num) = key;
     serialize_row(value, leaf_node_value(node, cursor->cell_num));
+    pager_mark_dirty(cursor->table->pager, cursor->page_num);
+
+    LearnedIndex *learned_index = table_learned_index(cursor->table);
+    if (learned_index != NULL) {
+        learned_index_leaf_changed(learned_index, cursor->table, cursor->page_num);
+    }
 }
 
 Cursor *leaf_node_find(Table *table, uint32_t page_num, uint32_t key) {
@@ -478,6 +1032,7 @@ Cursor *leaf_node_find(Table *table, uint32_t page_num, uint32_t key) {
 }
 
 void leaf_node_split_and_insert(Cursor *cursor, uint32_t key, Row *value) {
+    Pager *pager = cursor->table->pager;
     void *old_node = get_page(cursor->table->pager, cursor->page_num);
     uint32_t old_max = get_node_max_key(old_node);
     uint32_t new_page_num = get_unused_page_num(cursor->table->pager);
@@ -488,14 +1043,14 @@ void leaf_node_split_and_insert(Cursor *cursor, uint32_t key, Row *value) {
     *leaf_node_next_leaf(old_node) = new_page_num;
 
     // Split keys evenly between the two leaf nodes
-    for (int32_t i = LEAF_NODE_MAX_CELLS; i >= 0; i--) {
+    for (int32_t i = pager->leaf_node_max_cells; i >= 0; i--) {
         void *destination_node;
-        if (i >= LEAF_NODE_LEFT_SPLIT_COUNT) {
+        if (i >= pager->leaf_node_left_split_count) {
             destination_node = new_node;
         } else {
             destination_node = old_node;
         }
-        uint32_t index_within_node = i % LEAF_NODE_LEFT_SPLIT_COUNT;
+        uint32_t index_within_node = i % pager->leaf_node_left_split_count;
         void *destination = leaf_node_cell(destination_node, index_within_node);
 
         if (i == cursor->cell_num) {
@@ -508,19 +1063,30 @@ void leaf_node_split_and_insert(Cursor *cursor, uint32_t key, Row *value) {
         }
     }
 
-    *leaf_node_num_cells(old_node) = LEAF_NODE_LEFT_SPLIT_COUNT;
-    *leaf_node_num_cells(new_node) = LEAF_NODE_RIGHT_SPLIT_COUNT;
+    *leaf_node_num_cells(old_node) = pager->leaf_node_left_split_count;
+    *leaf_node_num_cells(new_node) = pager->leaf_node_right_split_count;
+    pager_mark_dirty(cursor->table->pager, cursor->page_num);
+    pager_mark_dirty(cursor->table->pager, new_page_num);
 
+    uint32_t left_page_num = cursor->page_num;
     if (is_node_root(old_node)) {
         create_new_root(cursor->table, new_page_num);
+        // The left half moved out of the root page
+        left_page_num = *internal_node_child(get_page(cursor->table->pager, cursor->table->root_page_num), 0);
     } else {
         uint32_t parent_page_num = *node_parent(old_node);
         uint32_t new_max = get_node_max_key(old_node);
         void *parent = get_page(cursor->table->pager, parent_page_num);
 
         update_internal_node_key(parent, old_max, new_max);
+        pager_mark_dirty(cursor->table->pager, parent_page_num);
         internal_node_insert(cursor->table, parent_page_num, new_page_num);
     }
+
+    LearnedIndex *learned_index = table_learned_index(cursor->table);
+    if (learned_index != NULL) {
+        learned_index_leaf_split(learned_index, cursor->table, cursor->page_num, left_page_num, new_page_num);
+    }
 }
 
 uint32_t *leaf_node_next_leaf(void *node) {
@@ -609,6 +1175,7 @@ void internal_node_insert(Table *table, uint32_t parent_page_num, uint32_t child
 
     uint32_t original_num_keys = *internal_node_num_keys(parent);
     *internal_node_num_keys(parent) = original_num_keys + 1;
+    pager_mark_dirty(table->pager, parent_page_num);
 
     if (original_num_keys >= INTERNAL_NODE_MAX_CELLS) {
         // TODO: Implement splitting internal node
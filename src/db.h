@@ -9,28 +9,95 @@
 #include <stddef.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sys/types.h>
 
 #define COLUMN_USERNAME_SIZE    32
 #define COLUMN_EMAIL_SIZE       255
 #define TABLE_MAX_PAGES         100
+#define COPY_FILENAME_SIZE      255
+#define BTREE_MAX_DEPTH         16
+#define TABLE_MAX_SNAPSHOTS     16
+#define DEFAULT_PAGE_SIZE       4096
+#define MIN_PAGE_SIZE           4096
+#define MAX_PAGE_SIZE           65536
+#define FILE_HEADER_SIZE        4096
+#define JOURNAL_PATH_SIZE       4096
 #define size_of_attribute(Struct, Attribute)    sizeof(((Struct *)0)->Attribute)
 
 typedef enum {
     STATEMENT_INSERT,
-    STATEMENT_SELECT
+    STATEMENT_SELECT,
+    STATEMENT_COPY,
+    STATEMENT_DELETE
 } StatementType;
 
 typedef enum {
     EXECUTE_SUCCESS,
     EXECUTE_ERROR_TABLE_FULL,
-    EXECUTE_ERROR_DUPLICATE_KEY
+    EXECUTE_ERROR_DUPLICATE_KEY,
+    EXECUTE_ERROR_IO,
+    EXECUTE_ERROR_UNSUPPORTED
 } ExecuteResult;
 
+typedef enum {
+    COLUMN_ID,
+    COLUMN_USERNAME,
+    COLUMN_EMAIL
+} Column;
+
+typedef enum {
+    COPY_FROM,
+    COPY_TO
+} CopyDirection;
+
+typedef enum {
+    COPY_FORMAT_CSV,
+    COPY_FORMAT_BINARY
+} CopyFormat;
+
+// How rows are organized in a file, fixed when the file is created
+typedef enum {
+    TABLE_BTREE,
+    TABLE_HASH
+} TableType;
+
+typedef struct LearnedIndex LearnedIndex;
+typedef struct Tracer Tracer;
+
 typedef struct {
     int fd;
-    uint32_t file_len;
+    // Length of the file on disk, which only changes when a commit is written
+    off_t file_len;
+    // Page 0 starts after the file header; 0 for headerless files from before it existed
+    off_t header_size;
+    uint32_t page_size;
+    // Node layout derived from page_size by pager_set_page_size()
+    uint32_t leaf_node_max_cells;
+    uint32_t leaf_node_left_split_count;
+    uint32_t leaf_node_right_split_count;
+    TableType type;
     uint32_t num_pages;
     void *pages[TABLE_MAX_PAGES];
+    // Value of change_counter when each page was last modified
+    uint64_t change_counter;
+    uint64_t page_changed_at[TABLE_MAX_PAGES];
+    // change_counter as of the last commit; pages stamped after it are dirty
+    uint64_t committed_counter;
+    char journal_path[JOURNAL_PATH_SIZE];
+    // Root to record in the file header at the next commit, and the one the header holds now
+    uint32_t root_page_num;
+    uint32_t committed_root_page_num;
+    // Pages no longer in the live tree, each reusable once no pinned snapshot is older than its version
+    uint32_t free_pages[TABLE_MAX_PAGES];
+    uint32_t free_page_versions[TABLE_MAX_PAGES];
+    uint32_t num_free_pages;
+    // Version of the oldest pinned snapshot, UINT32_MAX when none is pinned
+    uint32_t oldest_pinned_version;
+    // Page access trace, NULL unless tracing
+    Tracer *tracer;
+    uint16_t trace_source;
 } Pager;
 
 typedef struct {
@@ -43,26 +110,72 @@ typedef struct {
 //    void *pages[TABLE_MAX_PAGES];
     Pager *pager;
     uint32_t root_page_num;
+    // Root visible to snapshot readers: version in the high 32 bits, root page in the low 32 bits
+    _Atomic uint64_t published_root;
+    bool copy_on_write;
+    // Versions of the snapshots still being read, which keeps the pages they reach from being reused
+    uint32_t pinned_versions[TABLE_MAX_SNAPSHOTS];
+    uint32_t num_pinned;
+    size_t sort_memory_budget;
+    // Optional model over the leaves for point lookups, NULL when disabled
+    LearnedIndex *learned_index;
+    // Held by whoever touches the tree or pager while a background thread such as a backup is running
+    pthread_mutex_t mutex;
 } Table;
 
+typedef struct {
+    // where id = <key>
+    bool point;
+    uint32_t key;
+    bool ordered;
+    Column order_column;
+    bool descending;
+    // 0 means no limit
+    uint32_t limit;
+} SelectSpec;
+
+typedef struct {
+    CopyDirection direction;
+    CopyFormat format;
+    char filename[COPY_FILENAME_SIZE + 1];
+} CopySpec;
+
 typedef struct {
     StatementType type;
     Row row_to_insert;
+    uint32_t key_to_delete;
+    // Insert columns given as '?' placeholders, one bit per Column
+    uint32_t param_columns;
+    SelectSpec select;
+    CopySpec copy;
 } Statement;
 
 typedef struct {
     Table *table;
+    uint32_t root_page_num;
     uint32_t page_num;
     uint32_t cell_num;
     bool end_of_table;
 } Cursor;
 
+// A published root and everything reachable from it. Writers never modify these pages, but the page cache
+// itself is not synchronized, so readers on other threads still hold the table lock
+typedef struct {
+    Table *table;
+    uint32_t root_page_num;
+    uint32_t version;
+} Snapshot;
+
 typedef enum {
     INTERNAL_NODE,
     LEAF_NODE
 } NodeType;
 
-void print_constants();
+extern const uint32_t ROW_SIZE;
+extern const uint32_t FILE_HEADER_ROOT_PAGE_OFFSET;
+
+bool pager_set_page_size(Pager *pager, uint32_t page_size);
+void print_constants(Pager *pager);
 void print_tree(Pager *pager, uint32_t page_num, uint32_t indent_level);
 void print_row(Row *row);
 
@@ -70,18 +183,46 @@ void serialize_row(Row *source, void *destination);
 void deserialize_row(void *source, Row *destination);
 void *get_page(Pager *pager, uint32_t page_num);
 void pager_flush(Pager *pager, uint32_t page_num);
+void pager_truncate(Pager *pager, uint32_t num_pages);
+void pager_mark_dirty(Pager *pager, uint32_t page_num);
+void pager_commit(Pager *pager);
+off_t pager_page_offset(Pager *pager, uint32_t page_num);
+void pager_free_page(Pager *pager, uint32_t page_num, uint32_t version);
+uint32_t pager_available_pages(Pager *pager);
 uint32_t get_unused_page_num(Pager *pager);
 
+ExecuteResult table_insert(Table *table, Row *row);
+ExecuteResult cow_insert(Table *table, Row *row);
+ExecuteResult table_delete(Table *table, uint32_t key);
+LearnedIndex *table_learned_index(Table *table);
+bool table_lookup(Table *table, uint32_t key, Row *row);
 ExecuteResult execute_statement(Statement *statement, Table *table);
 ExecuteResult execute_insert(Statement *statement, Table *table);
 ExecuteResult execute_select(Statement *statement, Table *table);
 
-Table *open_db(const char *filename);
+Table *open_db(const char *filename, uint32_t page_size, TableType type);
 void close_db(Table *table);
+void commit_db(Table *table);
+void table_lock(Table *table);
+void table_unlock(Table *table);
+
+// Copy-on-write snapshots
+void publish_root(Table *table);
+Snapshot table_snapshot(Table *table);
+bool table_pin_snapshot(Table *table, Snapshot *snapshot);
+void table_release_snapshot(Table *table, Snapshot *snapshot);
+void table_free_unreachable(Table *table);
+Cursor *snapshot_start(Snapshot *snapshot);
+Cursor *snapshot_find(Snapshot *snapshot, uint32_t key);
+void relink_tree(Table *table);
+void relink_subtree(Pager *pager, uint32_t page_num, uint32_t parent_page_num, uint32_t *previous_leaf);
 
 Cursor *table_start(Table *table);
 Cursor *table_find(Table *table, uint32_t key);
+Cursor *tree_start(Table *table, uint32_t root_page_num);
+Cursor *tree_find(Table *table, uint32_t root_page_num, uint32_t key);
 void *cursor_ptr(Cursor *cursor);
+uint32_t cursor_key(Cursor *cursor);
 void cursor_advance(Cursor *cursor);
 
 // Shared btree
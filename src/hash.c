@@ -0,0 +1,274 @@
+//
+// Created by Matthew Emerson on 2/24/22.
+//
+
+#include <memory.h>
+#include <stdio.h>
+#include "hash.h"
+
+// Both page types start with the node type byte, padded to keep the fields aligned
+const uint32_t HASH_NODE_HEADER_SIZE = sizeof(uint32_t);
+
+// Directory page
+const uint32_t HASH_DIRECTORY_GLOBAL_DEPTH_OFFSET = HASH_NODE_HEADER_SIZE;
+const uint32_t HASH_DIRECTORY_ENTRIES_OFFSET = HASH_DIRECTORY_GLOBAL_DEPTH_OFFSET + sizeof(uint32_t);
+const uint32_t HASH_DIRECTORY_ENTRY_SIZE = sizeof(uint32_t);
+
+// Bucket page
+const uint32_t HASH_BUCKET_LOCAL_DEPTH_OFFSET = HASH_NODE_HEADER_SIZE;
+const uint32_t HASH_BUCKET_NUM_CELLS_OFFSET = HASH_BUCKET_LOCAL_DEPTH_OFFSET + sizeof(uint32_t);
+const uint32_t HASH_BUCKET_HEADER_SIZE = HASH_BUCKET_NUM_CELLS_OFFSET + sizeof(uint32_t);
+const uint32_t HASH_BUCKET_KEY_SIZE = sizeof(uint32_t);
+
+uint32_t hash_bucket_max_cells(Pager *pager) {
+    return (pager->page_size - HASH_BUCKET_HEADER_SIZE) / (HASH_BUCKET_KEY_SIZE + ROW_SIZE);
+}
+
+uint32_t hash_max_global_depth(Pager *pager) {
+    // Deepest directory that still fits in page 0
+    uint32_t max_entries = (pager->page_size - HASH_DIRECTORY_ENTRIES_OFFSET) / HASH_DIRECTORY_ENTRY_SIZE;
+    uint32_t depth = 0;
+    while ((2u << depth) <= max_entries) {
+        depth++;
+    }
+    return depth;
+}
+
+uint32_t hash_key(uint32_t key) {
+    // Finalizer from MurmurHash3, so sequential keys spread across the low bits the directory uses
+    key ^= key >> 16;
+    key *= 0x85ebca6b;
+    key ^= key >> 13;
+    key *= 0xc2b2ae35;
+    key ^= key >> 16;
+    return key;
+}
+
+uint32_t *hash_directory_global_depth(void *directory) {
+    return directory + HASH_DIRECTORY_GLOBAL_DEPTH_OFFSET;
+}
+
+uint32_t *hash_directory_entry(void *directory, uint32_t index) {
+    return directory + HASH_DIRECTORY_ENTRIES_OFFSET + index * HASH_DIRECTORY_ENTRY_SIZE;
+}
+
+uint32_t *hash_bucket_local_depth(void *bucket) {
+    return bucket + HASH_BUCKET_LOCAL_DEPTH_OFFSET;
+}
+
+uint32_t *hash_bucket_num_cells(void *bucket) {
+    return bucket + HASH_BUCKET_NUM_CELLS_OFFSET;
+}
+
+// Keys are packed together ahead of the rows so probing a bucket scans one contiguous array
+uint32_t *hash_bucket_key(void *bucket, uint32_t cell_num) {
+    return bucket + HASH_BUCKET_HEADER_SIZE + cell_num * HASH_BUCKET_KEY_SIZE;
+}
+
+void *hash_bucket_value(Pager *pager, void *bucket, uint32_t cell_num) {
+    return bucket + HASH_BUCKET_HEADER_SIZE + hash_bucket_max_cells(pager) * HASH_BUCKET_KEY_SIZE + cell_num * ROW_SIZE;
+}
+
+void hash_bucket_move_cell(Pager *pager, void *source, uint32_t source_cell_num, void *destination,
+                           uint32_t destination_cell_num) {
+    *hash_bucket_key(destination, destination_cell_num) = *hash_bucket_key(source, source_cell_num);
+    memcpy(hash_bucket_value(pager, destination, destination_cell_num),
+           hash_bucket_value(pager, source, source_cell_num), ROW_SIZE);
+}
+
+void set_hash_node_type(void *node, HashNodeType type) {
+    // Byte 0 of every page is its type, as for B-tree nodes
+    *((uint8_t *) node) = type;
+}
+
+void initialize_hash_bucket(void *bucket, uint32_t local_depth) {
+    set_hash_node_type(bucket, HASH_BUCKET_NODE);
+    *hash_bucket_local_depth(bucket) = local_depth;
+    *hash_bucket_num_cells(bucket) = 0;
+}
+
+void initialize_hash_table(Pager *pager) {
+    // Depth 0: a single directory entry pointing at the only bucket
+    void *directory = get_page(pager, 0);
+    set_hash_node_type(directory, HASH_DIRECTORY_NODE);
+    *hash_directory_global_depth(directory) = 0;
+    *hash_directory_entry(directory, 0) = 1;
+    initialize_hash_bucket(get_page(pager, 1), 0);
+    pager_mark_dirty(pager, 0);
+    pager_mark_dirty(pager, 1);
+}
+
+uint32_t hash_bucket_for_key(Pager *pager, uint32_t key) {
+    void *directory = get_page(pager, 0);
+    uint32_t mask = (1u << *hash_directory_global_depth(directory)) - 1;
+    return *hash_directory_entry(directory, hash_key(key) & mask);
+}
+
+uint32_t hash_bucket_find(void *bucket, uint32_t key) {
+    // Returns num_cells when the key is absent
+    uint32_t num_cells = *hash_bucket_num_cells(bucket);
+    uint32_t *keys = hash_bucket_key(bucket, 0);
+    for (uint32_t i = 0; i < num_cells; i++) {
+        if (keys[i] == key) {
+            return i;
+        }
+    }
+    return num_cells;
+}
+
+bool hash_split_bucket(Pager *pager, uint32_t bucket_page_num) {
+    void *directory = get_page(pager, 0);
+    void *bucket = get_page(pager, bucket_page_num);
+    uint32_t local_depth = *hash_bucket_local_depth(bucket);
+    uint32_t global_depth = *hash_directory_global_depth(directory);
+
+    if (pager->num_pages >= TABLE_MAX_PAGES) {
+        return false;
+    }
+    if (local_depth == global_depth) {
+        if (global_depth == hash_max_global_depth(pager)) {
+            return false;
+        }
+        // Double the directory; each new entry starts out sharing its twin's bucket
+        uint32_t num_entries = 1u << global_depth;
+        memcpy(hash_directory_entry(directory, num_entries), hash_directory_entry(directory, 0),
+               num_entries * HASH_DIRECTORY_ENTRY_SIZE);
+        *hash_directory_global_depth(directory) = ++global_depth;
+    }
+
+    uint32_t new_page_num = get_unused_page_num(pager);
+    void *new_bucket = get_page(pager, new_page_num);
+    initialize_hash_bucket(new_bucket, local_depth + 1);
+    *hash_bucket_local_depth(bucket) = local_depth + 1;
+
+    // Cells whose hash has the next bit set move to the new bucket
+    uint32_t num_cells = *hash_bucket_num_cells(bucket);
+    uint32_t kept = 0;
+    uint32_t moved = 0;
+    for (uint32_t i = 0; i < num_cells; i++) {
+        if ((hash_key(*hash_bucket_key(bucket, i)) >> local_depth) & 1) {
+            hash_bucket_move_cell(pager, bucket, i, new_bucket, moved++);
+        } else {
+            if (kept != i) {
+                hash_bucket_move_cell(pager, bucket, i, bucket, kept);
+            }
+            kept++;
+        }
+    }
+    *hash_bucket_num_cells(bucket) = kept;
+    *hash_bucket_num_cells(new_bucket) = moved;
+
+    uint32_t num_entries = 1u << global_depth;
+    for (uint32_t i = 0; i < num_entries; i++) {
+        if (*hash_directory_entry(directory, i) == bucket_page_num && ((i >> local_depth) & 1)) {
+            *hash_directory_entry(directory, i) = new_page_num;
+        }
+    }
+
+    pager_mark_dirty(pager, 0);
+    pager_mark_dirty(pager, bucket_page_num);
+    pager_mark_dirty(pager, new_page_num);
+    return true;
+}
+
+ExecuteResult hash_insert(Table *table, Row *row) {
+    Pager *pager = table->pager;
+    uint32_t key = row->id;
+
+    // A split may leave every cell on one side, so keep splitting until the key's bucket has room
+    while (1) {
+        uint32_t bucket_page_num = hash_bucket_for_key(pager, key);
+        void *bucket = get_page(pager, bucket_page_num);
+        uint32_t num_cells = *hash_bucket_num_cells(bucket);
+        if (hash_bucket_find(bucket, key) < num_cells) {
+            return EXECUTE_ERROR_DUPLICATE_KEY;
+        }
+
+        if (num_cells < hash_bucket_max_cells(pager)) {
+            *hash_bucket_key(bucket, num_cells) = key;
+            serialize_row(row, hash_bucket_value(pager, bucket, num_cells));
+            *hash_bucket_num_cells(bucket) = num_cells + 1;
+            pager_mark_dirty(pager, bucket_page_num);
+            return EXECUTE_SUCCESS;
+        }
+
+        if (!hash_split_bucket(pager, bucket_page_num)) {
+            return EXECUTE_ERROR_TABLE_FULL;
+        }
+    }
+}
+
+bool hash_lookup(Table *table, uint32_t key, Row *row) {
+    void *bucket = get_page(table->pager, hash_bucket_for_key(table->pager, key));
+    uint32_t cell_num = hash_bucket_find(bucket, key);
+    if (cell_num == *hash_bucket_num_cells(bucket)) {
+        return false;
+    }
+    deserialize_row(hash_bucket_value(table->pager, bucket, cell_num), row);
+    return true;
+}
+
+ExecuteResult hash_delete(Table *table, uint32_t key) {
+    // Buckets are not merged when they empty; deleting a missing key is not an error
+    Pager *pager = table->pager;
+    uint32_t bucket_page_num = hash_bucket_for_key(pager, key);
+    void *bucket = get_page(pager, bucket_page_num);
+    uint32_t num_cells = *hash_bucket_num_cells(bucket);
+    uint32_t cell_num = hash_bucket_find(bucket, key);
+    if (cell_num == num_cells) {
+        return EXECUTE_SUCCESS;
+    }
+
+    // Cells are unordered, so the last one fills the hole
+    if (cell_num != num_cells - 1) {
+        hash_bucket_move_cell(pager, bucket, num_cells - 1, bucket, cell_num);
+    }
+    *hash_bucket_num_cells(bucket) = num_cells - 1;
+    pager_mark_dirty(pager, bucket_page_num);
+    return EXECUTE_SUCCESS;
+}
+
+void hash_cursor_settle(Cursor *cursor) {
+    // Skip past exhausted and empty buckets
+    Pager *pager = cursor->table->pager;
+    while (cursor->page_num < pager->num_pages &&
+           cursor->cell_num >= *hash_bucket_num_cells(get_page(pager, cursor->page_num))) {
+        cursor->page_num++;
+        cursor->cell_num = 0;
+    }
+    cursor->end_of_table = cursor->page_num >= pager->num_pages;
+}
+
+Cursor *hash_start(Table *table) {
+    Cursor *cursor = malloc(sizeof(Cursor));
+    cursor->table = table;
+    cursor->root_page_num = 0;
+    cursor->page_num = 1;
+    cursor->cell_num = 0;
+    hash_cursor_settle(cursor);
+    return cursor;
+}
+
+void *hash_cursor_value(Cursor *cursor) {
+    return hash_bucket_value(cursor->table->pager, get_page(cursor->table->pager, cursor->page_num), cursor->cell_num);
+}
+
+uint32_t hash_cursor_key(Cursor *cursor) {
+    return *hash_bucket_key(get_page(cursor->table->pager, cursor->page_num), cursor->cell_num);
+}
+
+void hash_cursor_advance(Cursor *cursor) {
+    cursor->cell_num++;
+    hash_cursor_settle(cursor);
+}
+
+void print_hash_table(Pager *pager) {
+    void *directory = get_page(pager, 0);
+    uint32_t global_depth = *hash_directory_global_depth(directory);
+    printf("- directory (global depth %d, %d entries)\n", global_depth, 1u << global_depth);
+    for (uint32_t page_num = 1; page_num < pager->num_pages; page_num++) {
+        void *bucket = get_page(pager, page_num);
+        printf("  - bucket %d (local depth %d, size %d)\n", page_num, *hash_bucket_local_depth(bucket),
+               *hash_bucket_num_cells(bucket));
+    }
+}
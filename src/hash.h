@@ -0,0 +1,35 @@
+//
+// Created by Matthew Emerson on 2/24/22.
+//
+
+#ifndef TOUCHSTONE_HASH_H
+#define TOUCHSTONE_HASH_H
+
+#include "db.h"
+
+// Extendible hashing: page 0 is a directory of 2^global_depth bucket page numbers, every other page a bucket
+
+// Stored in the same type byte as NodeType, numbered after it so the two never collide
+typedef enum {
+    HASH_DIRECTORY_NODE = LEAF_NODE + 1,
+    HASH_BUCKET_NODE
+} HashNodeType;
+
+void initialize_hash_table(Pager *pager);
+uint32_t hash_key(uint32_t key);
+uint32_t hash_max_global_depth(Pager *pager);
+uint32_t hash_bucket_max_cells(Pager *pager);
+
+ExecuteResult hash_insert(Table *table, Row *row);
+bool hash_lookup(Table *table, uint32_t key, Row *row);
+ExecuteResult hash_delete(Table *table, uint32_t key);
+
+// Scans visit buckets in page order, so rows come back unordered
+Cursor *hash_start(Table *table);
+void *hash_cursor_value(Cursor *cursor);
+uint32_t hash_cursor_key(Cursor *cursor);
+void hash_cursor_advance(Cursor *cursor);
+
+void print_hash_table(Pager *pager);
+
+#endif //TOUCHSTONE_HASH_H
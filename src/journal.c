@@ -0,0 +1,136 @@
+//
+// Created by Matthew Emerson on 2/5/22.
+//
+
+#include <memory.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include "journal.h"
+
+void journal_path(char *destination, const char *filename) {
+    snprintf(destination, JOURNAL_PATH_SIZE, "%s" JOURNAL_SUFFIX, filename);
+}
+
+bool journal_write_all(int fd, const void *buffer, size_t len, off_t offset) {
+    size_t written = 0;
+    while (written < len) {
+        ssize_t bytes_written = pwrite(fd, buffer + written, len - written, offset + (off_t) written);
+        if (bytes_written == -1) {
+            printf("Error: Unable to write journal: %d\n", errno);
+            return false;
+        }
+        written += bytes_written;
+    }
+    return true;
+}
+
+bool journal_save(int fd, Pager *pager, off_t offset, uint32_t len, void *buffer, off_t *position) {
+    if (pread(pager->fd, buffer, len, offset) != (ssize_t) len) {
+        printf("Error: Unable to read DB file for the journal: %d\n", errno);
+        return false;
+    }
+    JournalRecord record = {(uint64_t) offset, len, 0};
+    if (!journal_write_all(fd, &record, sizeof(record), *position) ||
+        !journal_write_all(fd, buffer, len, *position + sizeof(record))) {
+        return false;
+    }
+    *position += sizeof(record) + len;
+    return true;
+}
+
+bool journal_write(Pager *pager, uint32_t *page_nums, uint32_t num_pages, bool save_header) {
+    // Records go first and the header last, so a journal without its magic was never finished and is ignored
+    int fd = open(pager->journal_path, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    if (fd == -1) {
+        printf("Error: Unable to open journal '%s': %d\n", pager->journal_path, errno);
+        return false;
+    }
+
+    JournalHeader header = {0};
+    header.file_len = pager->file_len;
+    off_t position = sizeof(JournalHeader);
+    void *buffer = malloc(pager->page_size > pager->header_size ? pager->page_size : pager->header_size);
+    bool succeeded = true;
+
+    if (save_header) {
+        succeeded = journal_save(fd, pager, 0, pager->header_size, buffer, &position);
+        header.num_records++;
+    }
+    for (uint32_t i = 0; i < num_pages && succeeded; i++) {
+        // Pages past the old end of the file have nothing to restore
+        off_t offset = pager_page_offset(pager, page_nums[i]);
+        if (offset + pager->page_size > pager->file_len) {
+            continue;
+        }
+        succeeded = journal_save(fd, pager, offset, pager->page_size, buffer, &position);
+        header.num_records++;
+    }
+    free(buffer);
+
+    if (succeeded) {
+        memcpy(header.magic, JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC));
+        header.version = JOURNAL_VERSION;
+        succeeded = fsync(fd) != -1 && journal_write_all(fd, &header, sizeof(header), 0) && fsync(fd) != -1;
+        if (!succeeded) {
+            printf("Error: Unable to sync journal '%s': %d\n", pager->journal_path, errno);
+        }
+    }
+    close(fd);
+    return succeeded;
+}
+
+void journal_remove(Pager *pager) {
+    // Deleting the journal is what makes the commit final
+    if (unlink(pager->journal_path) == -1) {
+        printf("Error: Unable to remove journal '%s': %d\n", pager->journal_path, errno);
+        exit(EXIT_FAILURE);
+    }
+}
+
+bool journal_recover(int fd, const char *path) {
+    // Rolls the DB file back to its last commit if a commit was interrupted part way through writing pages
+    int journal_fd = open(path, O_RDONLY);
+    if (journal_fd == -1) {
+        return true;
+    }
+
+    JournalHeader header;
+    if (pread(journal_fd, &header, sizeof(header), 0) == sizeof(header) &&
+        memcmp(header.magic, JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC)) == 0 && header.version == JOURNAL_VERSION) {
+        off_t position = sizeof(JournalHeader);
+        for (uint32_t i = 0; i < header.num_records; i++) {
+            JournalRecord record;
+            if (pread(journal_fd, &record, sizeof(record), position) != sizeof(record) ||
+                record.len > MAX_PAGE_SIZE) {
+                printf("Error: Corrupt journal '%s'\n", path);
+                close(journal_fd);
+                return false;
+            }
+            void *data = malloc(record.len);
+            if (pread(journal_fd, data, record.len, position + sizeof(record)) != (ssize_t) record.len ||
+                pwrite(fd, data, record.len, (off_t) record.offset) != (ssize_t) record.len) {
+                printf("Error: Unable to roll back from journal '%s': %d\n", path, errno);
+                free(data);
+                close(journal_fd);
+                return false;
+            }
+            free(data);
+            position += sizeof(record) + record.len;
+        }
+        if (ftruncate(fd, (off_t) header.file_len) == -1 || fsync(fd) == -1) {
+            printf("Error: Unable to roll back from journal '%s': %d\n", path, errno);
+            close(journal_fd);
+            return false;
+        }
+    }
+
+    // The journal is only removed once the rollback is durable, so a failed recovery is retried on the next open
+    close(journal_fd);
+    if (unlink(path) == -1) {
+        printf("Error: Unable to remove journal '%s': %d\n", path, errno);
+        return false;
+    }
+    return true;
+}
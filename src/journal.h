@@ -0,0 +1,35 @@
+//
+// Created by Matthew Emerson on 2/5/22.
+//
+
+#ifndef TOUCHSTONE_JOURNAL_H
+#define TOUCHSTONE_JOURNAL_H
+
+#include "db.h"
+
+#define JOURNAL_MAGIC   "touchstone jrnl"
+#define JOURNAL_VERSION 1
+#define JOURNAL_SUFFIX  "-journal"
+
+// Rollback journal: the bytes a commit is about to overwrite, saved next to the DB file until the commit is durable
+
+typedef struct {
+    char magic[16];
+    uint32_t version;
+    uint32_t num_records;
+    // DB file length before the commit, restored on rollback so pages the commit appended are cut off
+    uint64_t file_len;
+} JournalHeader;
+
+typedef struct {
+    uint64_t offset;
+    uint32_t len;
+    uint32_t reserved;
+} JournalRecord;
+
+void journal_path(char *destination, const char *filename);
+bool journal_write(Pager *pager, uint32_t *page_nums, uint32_t num_pages, bool save_header);
+void journal_remove(Pager *pager);
+bool journal_recover(int fd, const char *path);
+
+#endif //TOUCHSTONE_JOURNAL_H
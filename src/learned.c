@@ -0,0 +1,212 @@
+//
+// Created by Matthew Emerson on 2/16/22.
+//
+
+#include <string.h>
+#include "learned.h"
+
+LearnedIndex *new_learned_index(Table *table) {
+    LearnedIndex *index = malloc(sizeof(LearnedIndex));
+    index->hits = 0;
+    index->misses = 0;
+    learned_index_build(index, table);
+    return index;
+}
+
+void learned_index_collect(LearnedIndex *index, Pager *pager, uint32_t page_num) {
+    void *node = get_page(pager, page_num);
+    switch (get_node_type(node)) {
+        case INTERNAL_NODE: {
+            uint32_t num_keys = *internal_node_num_keys(node);
+            for (uint32_t i = 0; i <= num_keys; i++) {
+                learned_index_collect(index, pager, *internal_node_child(node, i));
+            }
+            break;
+        }
+        case LEAF_NODE:
+            if (*leaf_node_num_cells(node) == 0) {
+                return;
+            }
+            LearnedSegment *segment = &index->segments[index->num_segments++];
+            segment->page_num = page_num;
+            learned_index_fit_leaf(segment, node);
+            break;
+    }
+}
+
+void learned_index_build(LearnedIndex *index, Table *table) {
+    index->num_segments = 0;
+    learned_index_collect(index, table->pager, table->root_page_num);
+    learned_index_refit(index);
+}
+
+uint32_t prediction_error(double predicted, uint32_t actual) {
+    double error = predicted - actual;
+    if (error < 0) {
+        error = -error;
+    }
+    return (uint32_t) error + 1;
+}
+
+void learned_index_refit(LearnedIndex *index) {
+    // A single line through the leaf max keys maps a key to its leaf
+    uint32_t num_segments = index->num_segments;
+    index->slope = 0;
+    index->max_error = 0;
+    if (num_segments < 2) {
+        return;
+    }
+
+    LearnedSegment *segments = index->segments;
+    uint32_t key_range = segments[num_segments - 1].max_key - segments[0].max_key;
+    if (key_range > 0) {
+        index->slope = (double) (num_segments - 1) / key_range;
+    }
+    for (uint32_t i = 0; i < num_segments; i++) {
+        uint32_t error = prediction_error((segments[i].max_key - segments[0].max_key) * index->slope, i);
+        if (error > index->max_error) {
+            index->max_error = error;
+        }
+    }
+}
+
+void learned_index_fit_leaf(LearnedSegment *segment, void *node) {
+    uint32_t num_cells = *leaf_node_num_cells(node);
+    segment->num_cells = num_cells;
+    segment->min_key = *leaf_node_key(node, 0);
+    segment->max_key = *leaf_node_key(node, num_cells - 1);
+    segment->slope = 0;
+    segment->max_error = 0;
+    if (segment->max_key > segment->min_key) {
+        segment->slope = (double) (num_cells - 1) / (segment->max_key - segment->min_key);
+    }
+
+    for (uint32_t i = 0; i < num_cells; i++) {
+        uint32_t error = prediction_error((*leaf_node_key(node, i) - segment->min_key) * segment->slope, i);
+        if (error > segment->max_error) {
+            segment->max_error = error;
+        }
+    }
+}
+
+int32_t learned_index_segment(LearnedIndex *index, uint32_t page_num) {
+    for (uint32_t i = 0; i < index->num_segments; i++) {
+        if (index->segments[i].page_num == page_num) {
+            return (int32_t) i;
+        }
+    }
+    return -1;
+}
+
+void learned_index_leaf_changed(LearnedIndex *index, Table *table, uint32_t page_num) {
+    int32_t segment_num = learned_index_segment(index, page_num);
+    if (segment_num == -1) {
+        // A leaf that was empty at build time has no segment yet
+        learned_index_build(index, table);
+        return;
+    }
+
+    LearnedSegment *segment = &index->segments[segment_num];
+    uint32_t old_max_key = segment->max_key;
+    learned_index_fit_leaf(segment, get_page(table->pager, page_num));
+    if (segment->max_key != old_max_key) {
+        learned_index_refit(index);
+    }
+}
+
+void learned_index_leaf_split(LearnedIndex *index, Table *table, uint32_t old_page_num, uint32_t left_page_num,
+                              uint32_t right_page_num) {
+    int32_t segment_num = learned_index_segment(index, old_page_num);
+    if (segment_num == -1 || index->num_segments == TABLE_MAX_PAGES) {
+        learned_index_build(index, table);
+        return;
+    }
+
+    // Replace the split leaf's segment with one for each half
+    LearnedSegment *segments = index->segments;
+    memmove(&segments[segment_num + 2], &segments[segment_num + 1],
+            (index->num_segments - segment_num - 1) * sizeof(LearnedSegment));
+    index->num_segments++;
+
+    segments[segment_num].page_num = left_page_num;
+    learned_index_fit_leaf(&segments[segment_num], get_page(table->pager, left_page_num));
+    segments[segment_num + 1].page_num = right_page_num;
+    learned_index_fit_leaf(&segments[segment_num + 1], get_page(table->pager, right_page_num));
+    learned_index_refit(index);
+}
+
+Cursor *learned_index_find(LearnedIndex *index, Table *table, uint32_t key) {
+    uint32_t num_segments = index->num_segments;
+    if (num_segments == 0) {
+        return NULL;
+    }
+    LearnedSegment *segments = index->segments;
+
+    // Predict the leaf, then search only the error window for the first leaf whose max key is >= key
+    int64_t guess = 0;
+    if (key > segments[0].max_key) {
+        guess = (int64_t) ((key - segments[0].max_key) * index->slope);
+    }
+    int64_t low = guess - index->max_error;
+    int64_t high = guess + index->max_error;
+    if (low < 0) {
+        low = 0;
+    }
+    if (high > num_segments - 1) {
+        high = num_segments - 1;
+    }
+    if (low > high || (low > 0 && segments[low - 1].max_key >= key) ||
+        (high < num_segments - 1 && segments[high].max_key < key)) {
+        index->misses++;
+        return NULL;
+    }
+    while (low < high) {
+        int64_t mid = (low + high) / 2;
+        if (segments[mid].max_key >= key) {
+            high = mid;
+        } else {
+            low = mid + 1;
+        }
+    }
+    LearnedSegment *segment = &segments[low];
+
+    // Same again inside the leaf for the first cell whose key is >= key
+    void *node = get_page(table->pager, segment->page_num);
+    int64_t cell = 0;
+    if (key > segment->min_key) {
+        cell = (int64_t) ((key - segment->min_key) * segment->slope);
+    }
+    int64_t first = cell - segment->max_error;
+    int64_t last = cell + segment->max_error + 1;
+    if (first < 0) {
+        first = 0;
+    }
+    if (last > segment->num_cells) {
+        last = segment->num_cells;
+    }
+    if ((first > 0 && *leaf_node_key(node, first - 1) >= key) ||
+        (last < segment->num_cells && *leaf_node_key(node, last) < key)) {
+        index->misses++;
+        Cursor *cursor = leaf_node_find(table, segment->page_num, key);
+        cursor->root_page_num = table->root_page_num;
+        cursor->end_of_table = false;
+        return cursor;
+    }
+    while (first < last) {
+        int64_t mid = (first + last) / 2;
+        if (*leaf_node_key(node, mid) >= key) {
+            last = mid;
+        } else {
+            first = mid + 1;
+        }
+    }
+
+    index->hits++;
+    Cursor *cursor = malloc(sizeof(Cursor));
+    cursor->table = table;
+    cursor->root_page_num = table->root_page_num;
+    cursor->page_num = segment->page_num;
+    cursor->cell_num = first;
+    cursor->end_of_table = false;
+    return cursor;
+}
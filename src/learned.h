@@ -0,0 +1,40 @@
+//
+// Created by Matthew Emerson on 2/16/22.
+//
+
+#ifndef TOUCHSTONE_LEARNED_H
+#define TOUCHSTONE_LEARNED_H
+
+#include "db.h"
+
+typedef struct {
+    uint32_t page_num;
+    uint32_t min_key;
+    uint32_t max_key;
+    uint32_t num_cells;
+    // Predicted cell = (key - min_key) * slope, off by at most max_error cells
+    double slope;
+    uint32_t max_error;
+} LearnedSegment;
+
+struct LearnedIndex {
+    // One segment per leaf, in key order
+    LearnedSegment segments[TABLE_MAX_PAGES];
+    uint32_t num_segments;
+    // Predicted segment = (key - segments[0].max_key) * slope, off by at most max_error segments
+    double slope;
+    uint32_t max_error;
+    uint64_t hits;
+    uint64_t misses;
+};
+
+LearnedIndex *new_learned_index(Table *table);
+void learned_index_build(LearnedIndex *index, Table *table);
+void learned_index_refit(LearnedIndex *index);
+void learned_index_fit_leaf(LearnedSegment *segment, void *node);
+void learned_index_leaf_changed(LearnedIndex *index, Table *table, uint32_t page_num);
+void learned_index_leaf_split(LearnedIndex *index, Table *table, uint32_t old_page_num, uint32_t left_page_num,
+                              uint32_t right_page_num);
+Cursor *learned_index_find(LearnedIndex *index, Table *table, uint32_t key);
+
+#endif //TOUCHSTONE_LEARNED_H
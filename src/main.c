@@ -1,13 +1,144 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <inttypes.h>
+#include <unistd.h>
 #include "compiler.h"
 #include "repl.h"
+#include "touchstone.h"
+#include "vacuum.h"
+#include "learned.h"
+#include "hash.h"
 
+#define SCRIPT_BATCH_SIZE 1000
 
-CommandResult execute_command(InputBuffer *input, Table *table) {
+typedef struct {
+    uint32_t inserts;
+    uint32_t selects;
+    uint32_t copies;
+    uint32_t deletes;
+    uint32_t batches;
+    uint32_t errors;
+} BatchStats;
+
+Snapshot pinned_snapshot;
+bool has_pinned_snapshot = false;
+
+void execute_snapshot_command(InputBuffer *input, Table *table) {
+    if (strcmp(input->buffer, ".snapshot") == 0) {
+        if (!table->copy_on_write) {
+            printf("Error: Snapshots require --copy-on-write\n");
+            return;
+        }
+        if (has_pinned_snapshot) {
+            table_release_snapshot(table, &pinned_snapshot);
+        }
+        has_pinned_snapshot = table_pin_snapshot(table, &pinned_snapshot);
+        printf("Pinned snapshot version %d\n", pinned_snapshot.version);
+    } else if (!has_pinned_snapshot) {
+        printf("Error: No snapshot pinned\n");
+    } else if (strcmp(input->buffer, ".snapshot release") == 0) {
+        table_release_snapshot(table, &pinned_snapshot);
+        has_pinned_snapshot = false;
+        printf("Released snapshot version %d\n", pinned_snapshot.version);
+    } else {
+        Cursor *cursor = snapshot_start(&pinned_snapshot);
+        Row row;
+        while (!cursor->end_of_table) {
+            deserialize_row(cursor_ptr(cursor), &row);
+            print_row(&row);
+            printf("\n");
+            cursor_advance(cursor);
+        }
+        free(cursor);
+    }
+}
+
+void execute_backup_command(InputBuffer *input, TouchstoneDb *db) {
+    // .backup reports progress, .backup <path> [bytes_per_sec] starts a new one
+    // Skip the keyword
+    strtok(input->buffer, " ");
+    char *path = strtok(NULL, " ");
+    char *rate_str = strtok(NULL, " ");
+
+    if (path == NULL) {
+        Backup *backup = db->backup;
+        if (backup == NULL) {
+            printf("No backup started\n");
+        } else if (!backup_done(backup)) {
+            printf("Backup to '%s' running\n", backup->path);
+        } else {
+            printf("Backup to '%s' %s: %d pages copied, %d re-copied in %d passes, %" PRIu64 " bytes written\n",
+                   backup->path, backup->failed ? "failed" : "complete", backup->pages_copied,
+                   backup->pages_recopied, backup->passes, backup->bytes_written);
+        }
+        return;
+    }
+
+    uint64_t bytes_per_sec = rate_str != NULL ? strtoull(rate_str, NULL, 10) : 0;
+    switch (touchstone_backup(db, path, bytes_per_sec)) {
+        case TOUCHSTONE_OK:
+            printf("Backing up to '%s'\n", path);
+            break;
+        case TOUCHSTONE_ERROR_MISUSE:
+            printf("Error: A backup is already running\n");
+            break;
+        default:
+            break;
+    }
+}
+
+void print_replication_status(TouchstoneDb *db) {
+    if (db->primary != NULL) {
+        ReplicationPrimary *primary = db->primary;
+        printf("Primary on '%s': follower %s, %" PRIu64 " batches, %" PRIu64 " pages sent, shipped through change %"
+               PRIu64 " of %" PRIu64 "\n",
+               primary->path, primary->follower_connected ? "connected" : "disconnected", primary->batches_sent,
+               primary->pages_sent, primary->sent_counter, db->table->pager->change_counter);
+    } else if (db->follower != NULL) {
+        ReplicationFollower *follower = db->follower;
+        printf("Follower of '%s': %s, %" PRIu64 " batches, %" PRIu64 " pages applied through change %" PRIu64 ", %"
+               PRIu64 " reconnects, lag %" PRIu64 " us (max %" PRIu64 " us)\n", follower->path, follower->connected ? "connected" : "disconnected",
+               follower->batches_applied, follower->pages_applied, follower->applied_counter,
+               follower->reconnects, follower->last_lag_us, follower->max_lag_us);
+    } else {
+        printf("Not replicating\n");
+    }
+}
+
+CommandResult execute_table_command(InputBuffer *input, Table *table) {
+    if (strcmp(input->buffer, ".print_tree") == 0) {
+        printf("Tree:\n");
+        if (table->pager->type == TABLE_HASH) {
+            print_hash_table(table->pager);
+        } else {
+            print_tree(table->pager, table->root_page_num, 0);
+        }
+        return COMMAND_SUCCESS;
+    } else if (strcmp(input->buffer, ".snapshot") == 0 || strcmp(input->buffer, ".snapshot select") == 0 ||
+               strcmp(input->buffer, ".snapshot release") == 0) {
+        execute_snapshot_command(input, table);
+        return COMMAND_SUCCESS;
+    } else if (strcmp(input->buffer, ".learned_index") == 0) {
+        LearnedIndex *learned_index = table_learned_index(table);
+        if (learned_index == NULL) {
+            printf("Learned index disabled\n");
+        } else {
+            printf("Learned index: %d segments, error window %d, %" PRIu64 " hits, %" PRIu64 " misses\n",
+                   learned_index->num_segments, learned_index->max_error, learned_index->hits,
+                   learned_index->misses);
+        }
+        return COMMAND_SUCCESS;
+    } else {
+        debug_input(input);
+        return COMMAND_ERROR_NOT_FOUND;
+    }
+}
+
+CommandResult execute_command(InputBuffer *input, TouchstoneDb *db) {
+    Table *table = touchstone_table(db);
     if (strcmp(input->buffer, ".exit") == 0) {
         close_input(input);
-        close_db(table);
+        touchstone_close(db);
         printf("Goodbye\n");
         exit(EXIT_SUCCESS);
     } else if (strcmp(input->buffer, ".version") == 0) {
@@ -15,16 +146,188 @@ CommandResult execute_command(InputBuffer *input, Table *table) {
         return COMMAND_SUCCESS;
     } else if (strcmp(input->buffer, ".constants") == 0) {
         printf("Constants:\n");
-        print_constants();
+        // Every shard file is created with the same page size
+        print_constants(table != NULL ? table->pager : db->sharded->shards[0].table->pager);
         return COMMAND_SUCCESS;
-    } else if (strcmp(input->buffer, ".print_tree") == 0) {
-        printf("Tree:\n");
-        print_tree(table->pager, 0, 0);
+    } else if (strcmp(input->buffer, ".shards") == 0) {
+        if (db->sharded == NULL) {
+            printf("Not sharded\n");
+            return COMMAND_SUCCESS;
+        }
+        sharded_sync(db->sharded);
+        for (uint32_t i = 0; i < db->sharded->num_shards; i++) {
+            Shard *shard = &db->sharded->shards[i];
+            printf("Shard %d: keys from %u, %" PRIu64 " inserted, %" PRIu64 " rejected\n", i, i * db->sharded->key_span,
+                   shard->rows_inserted, shard->rows_rejected);
+        }
         return COMMAND_SUCCESS;
-    } else {
-        debug_input(input);
-        return COMMAND_ERROR_NOT_FOUND;
+    } else if (table == NULL) {
+        printf("Error: '%s' is not supported on sharded databases\n", input->buffer);
+        return COMMAND_SUCCESS;
+    } else if (strncmp(input->buffer, ".backup", 7) == 0 && (input->buffer[7] == ' ' || input->buffer[7] == '\0')) {
+        execute_backup_command(input, db);
+        return COMMAND_SUCCESS;
+    } else if (strcmp(input->buffer, ".replication") == 0) {
+        print_replication_status(db);
+        return COMMAND_SUCCESS;
+    } else if (db->follower != NULL && strcmp(input->buffer, ".vacuum") == 0) {
+        printf("Error: Followers are read-only\n");
+        return COMMAND_SUCCESS;
+    } else if (strcmp(input->buffer, ".vacuum") == 0) {
+        // Vacuum takes the table lock per step so a running backup can make progress in between
+        VacuumStats stats = {0};
+        VacuumResult result = vacuum(table, &stats);
+        if (result == VACUUM_ERROR_UNSUPPORTED) {
+            printf("Error: '.vacuum' is not supported on hash tables\n");
+        } else if (result == VACUUM_ERROR_SNAPSHOT_PINNED) {
+            printf("Error: Release the pinned snapshot before '.vacuum'\n");
+        } else {
+            printf("Vacuum moved %d pages, released %d, %d pages in use\n", stats.pages_moved,
+                   stats.pages_released, stats.num_pages);
+        }
+        return COMMAND_SUCCESS;
+    }
+
+    // The tree is shared with any running backup, so meta commands hold the table lock like statements do
+    table_lock(table);
+    CommandResult result = execute_table_command(input, table);
+    table_unlock(table);
+    return result;
+}
+
+TouchstoneResult run_statement(TouchstoneDb *db, const char *sql, StatementType *type) {
+    TouchstoneStmt *stmt;
+    TouchstoneResult result = touchstone_prepare(db, sql, &stmt);
+    if (result != TOUCHSTONE_OK) {
+        return result;
+    }
+    *type = touchstone_statement_type(stmt);
+
+    while ((result = touchstone_step(stmt)) == TOUCHSTONE_ROW) {
+        print_row((Row *) touchstone_row(stmt));
+        printf("\n");
     }
+    touchstone_finalize(stmt);
+    return result;
+}
+
+void print_statement_error(TouchstoneResult result, const char *sql) {
+    switch (result) {
+        case TOUCHSTONE_ERROR_UNRECOGNIZED:
+            printf("Unrecognized keyword '%s'\n", sql);
+            break;
+        case TOUCHSTONE_ERROR_SYNTAX:
+            printf("Syntax error: '%s'\n", sql);
+            break;
+        case TOUCHSTONE_ERROR_OUT_OF_BOUNDS:
+            printf("Argument out of bounds: '%s'\n", sql);
+            break;
+        case TOUCHSTONE_ERROR_DUPLICATE_KEY:
+            printf("Duplicate key\n");
+            break;
+        case TOUCHSTONE_ERROR_TABLE_FULL:
+            printf("Table full\n");
+            break;
+        case TOUCHSTONE_ERROR_IO:
+            printf("Copy failed\n");
+            break;
+        case TOUCHSTONE_ERROR_MISUSE:
+            printf("Unbound parameter in '%s'\n", sql);
+            break;
+        case TOUCHSTONE_ERROR_READ_ONLY:
+            printf("Followers are read-only\n");
+            break;
+        case TOUCHSTONE_ERROR_UNSUPPORTED:
+            printf("Not supported on this table type: '%s'\n", sql);
+            break;
+        default:
+            printf("Unexpected result %d\n", result);
+            break;
+    }
+}
+
+void report_sharded_errors(TouchstoneDb *db, BatchStats *stats) {
+    // Queued shard inserts were counted when they were accepted; take back the ones the workers rejected
+    uint32_t num_failed;
+    TouchstoneResult first_error = touchstone_sync(db, &num_failed);
+    if (num_failed > 0) {
+        printf("Error: %d queued inserts failed, first: ", num_failed);
+        print_statement_error(first_error, "insert");
+        stats->inserts -= num_failed;
+        stats->errors += num_failed;
+    }
+}
+
+void run_script(TouchstoneDb *db, FILE *script) {
+    ScriptReader *reader = new_script_reader(script);
+    InputBuffer *input = new_input_buffer();
+    BatchStats stats = {0};
+    uint32_t statements_in_batch = 0;
+    uint32_t line_num = 0;
+
+    while (read_script_line(reader, input)) {
+        line_num++;
+        if (input->input_len == 0) {
+            continue;
+        }
+
+        if (input->buffer[0] == '.') {
+            if (strcmp(input->buffer, ".exit") == 0) {
+                break;
+            }
+            if (execute_command(input, db) == COMMAND_ERROR_NOT_FOUND) {
+                printf("Error: line %d: Unrecognized command '%s'.\n", line_num, input->buffer);
+                stats.errors++;
+            }
+            continue;
+        }
+
+        StatementType type;
+        TouchstoneResult result = run_statement(db, input->buffer, &type);
+        if (result != TOUCHSTONE_DONE) {
+            printf("Error: line %d: ", line_num);
+            print_statement_error(result, input->buffer);
+            stats.errors++;
+            continue;
+        }
+
+        switch (type) {
+            case STATEMENT_INSERT:
+                stats.inserts++;
+                break;
+            case STATEMENT_SELECT:
+                stats.selects++;
+                break;
+            case STATEMENT_COPY:
+                stats.copies++;
+                break;
+            case STATEMENT_DELETE:
+                stats.deletes++;
+                break;
+        }
+
+        // Consecutive statements are committed together rather than one at a time
+        statements_in_batch++;
+        if (statements_in_batch == SCRIPT_BATCH_SIZE) {
+            report_sharded_errors(db, &stats);
+            touchstone_commit(db);
+            stats.batches++;
+            statements_in_batch = 0;
+        }
+    }
+
+    if (statements_in_batch > 0) {
+        stats.batches++;
+    }
+    report_sharded_errors(db, &stats);
+
+    close_input(input);
+    close_script_reader(reader);
+    touchstone_close(db);
+
+    printf("Executed %d statements (%d inserts, %d selects, %d deletes, %d copies) in %d batches, %d errors\n",
+           stats.inserts + stats.selects + stats.deletes + stats.copies, stats.inserts, stats.selects,
+           stats.deletes, stats.copies, stats.batches, stats.errors);
 }
 
 int main(int argc, char *argv[]) {
@@ -34,7 +337,124 @@ int main(int argc, char *argv[]) {
     }
 
     char *filename = argv[1];
-    Table *table = open_db(filename);
+    char *script_filename = NULL;
+    bool copy_on_write = false;
+    size_t sort_memory_budget = SORT_DEFAULT_MEMORY_BUDGET;
+    uint32_t page_size = 0;
+    bool learned_index = false;
+    TableType table_type = TABLE_BTREE;
+    uint32_t num_shards = 0;
+    uint32_t shard_key_span = 0;
+    char *replicate_path = NULL;
+    char *follow_path = NULL;
+    char *trace_path = NULL;
+    for (int i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "-f") == 0 && i + 1 < argc) {
+            script_filename = argv[++i];
+        } else if (strcmp(argv[i], "--copy-on-write") == 0) {
+            copy_on_write = true;
+        } else if (strcmp(argv[i], "--sort-memory") == 0 && i + 1 < argc) {
+            sort_memory_budget = strtoull(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--hash") == 0) {
+            table_type = TABLE_HASH;
+        } else if (strcmp(argv[i], "--learned-index") == 0) {
+            learned_index = true;
+        } else if (strcmp(argv[i], "--shards") == 0 && i + 1 < argc) {
+            num_shards = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--shard-span") == 0 && i + 1 < argc) {
+            shard_key_span = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--replicate") == 0 && i + 1 < argc) {
+            replicate_path = argv[++i];
+        } else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+            trace_path = argv[++i];
+        } else if (strcmp(argv[i], "--follow") == 0 && i + 1 < argc) {
+            follow_path = argv[++i];
+        } else if (strcmp(argv[i], "--page-size") == 0 && i + 1 < argc) {
+            page_size = strtoul(argv[++i], NULL, 10);
+            if (page_size < MIN_PAGE_SIZE || page_size > MAX_PAGE_SIZE || (page_size & (page_size - 1)) != 0) {
+                printf("Error: Page size must be a power of two from %d to %d\n", MIN_PAGE_SIZE, MAX_PAGE_SIZE);
+                exit(EXIT_FAILURE);
+            }
+        } else {
+            printf("Usage: %s <db> [-f script] [--hash] [--copy-on-write] [--sort-memory bytes] [--page-size bytes] "
+                   "[--learned-index] [--shards n [--shard-span keys]] [--replicate socket | --follow socket] "
+                   "[--trace file]\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    TouchstoneDb *db;
+    if (table_type == TABLE_HASH && (num_shards > 0 || follow_path != NULL)) {
+        printf("Error: --hash cannot be combined with --shards or --follow\n");
+        exit(EXIT_FAILURE);
+    }
+    if ((replicate_path != NULL || follow_path != NULL) && num_shards > 0) {
+        printf("Error: Sharded databases cannot be replicated\n");
+        exit(EXIT_FAILURE);
+    }
+    if (follow_path != NULL) {
+        // A follower takes its page size and copy-on-write mode from the primary
+        if (replicate_path != NULL || copy_on_write || page_size != 0) {
+            printf("Error: --follow cannot be combined with --replicate, --copy-on-write or --page-size\n");
+            exit(EXIT_FAILURE);
+        }
+        if (touchstone_open_follower(filename, follow_path, &db) != TOUCHSTONE_OK) {
+            printf("Error: Unable to follow primary on '%s'\n", follow_path);
+            exit(EXIT_FAILURE);
+        }
+        if (learned_index && touchstone_table(db)->pager->type == TABLE_HASH) {
+            printf("Error: Hash tables do not support --learned-index\n");
+            exit(EXIT_FAILURE);
+        }
+        if (learned_index) {
+            touchstone_table(db)->learned_index = new_learned_index(touchstone_table(db));
+        }
+    } else if (num_shards > 0) {
+        if (copy_on_write || learned_index) {
+            printf("Error: --shards cannot be combined with --copy-on-write or --learned-index\n");
+            exit(EXIT_FAILURE);
+        }
+        if (touchstone_open_sharded(filename, num_shards, shard_key_span, page_size, &db) != TOUCHSTONE_OK) {
+            exit(EXIT_FAILURE);
+        }
+    } else {
+        if (touchstone_open_with_type(filename, page_size, table_type, &db) != TOUCHSTONE_OK) {
+            exit(EXIT_FAILURE);
+        }
+        // An existing file keeps the type it was created with
+        if (touchstone_table(db)->pager->type == TABLE_HASH && (copy_on_write || learned_index)) {
+            printf("Error: Hash tables do not support --copy-on-write or --learned-index\n");
+            exit(EXIT_FAILURE);
+        }
+        touchstone_table(db)->copy_on_write = copy_on_write;
+        if (learned_index) {
+            touchstone_table(db)->learned_index = new_learned_index(touchstone_table(db));
+        }
+    }
+    touchstone_set_sort_memory(db, sort_memory_budget);
+    if (trace_path != NULL && touchstone_trace(db, trace_path) != TOUCHSTONE_OK) {
+        exit(EXIT_FAILURE);
+    }
+    if (replicate_path != NULL && touchstone_replicate(db, replicate_path) != TOUCHSTONE_OK) {
+        exit(EXIT_FAILURE);
+    }
+
+    if (script_filename != NULL) {
+        FILE *script = fopen(script_filename, "r");
+        if (script == NULL) {
+            printf("Error: Unable to open script '%s'\n", script_filename);
+            exit(EXIT_FAILURE);
+        }
+        run_script(db, script);
+        fclose(script);
+        return EXIT_SUCCESS;
+    }
+
+    if (!isatty(STDIN_FILENO)) {
+        run_script(db, stdin);
+        return EXIT_SUCCESS;
+    }
+
     InputBuffer *input = new_input_buffer();
 
     while (1) {
@@ -42,7 +462,7 @@ int main(int argc, char *argv[]) {
         read_input(input);
 
         if (input->buffer[0] == '.') {
-            switch (execute_command(input, table)) {
+            switch (execute_command(input, db)) {
                 case COMMAND_SUCCESS:
                     break;
                 case COMMAND_ERROR_NOT_FOUND:
@@ -53,31 +473,21 @@ int main(int argc, char *argv[]) {
             continue;
         }
 
-        Statement statement;
-        switch (prepare_statement(input, &statement)) {
-            case PREPARE_SUCCESS:
-                break;
-            case PREPARE_ERROR_NOT_FOUND:
-                printf("Error: Unrecognized keyword '%s'\n", input->buffer);
-                continue;
-            case PREPARE_ERROR_SYNTAX:
-                printf("Error: Syntax error: '%s'\n", input->buffer);
-                continue;
-            case PREPARE_ERROR_OUT_OF_BOUNDS:
-                printf("Error: Argument out of bounds: '%s'\n", input->buffer);
-                break;
+        StatementType type;
+        TouchstoneResult result = run_statement(db, input->buffer, &type);
+        uint32_t num_failed;
+        if (result == TOUCHSTONE_DONE && type == STATEMENT_INSERT) {
+            // A sharded insert has only been queued; wait for it so a duplicate is reported here
+            TouchstoneResult sync_result = touchstone_sync(db, &num_failed);
+            if (num_failed > 0) {
+                result = sync_result;
+            }
         }
-
-        switch (execute_statement(&statement, table)) {
-            case EXECUTE_SUCCESS:
-                printf("Done\n");
-                break;
-            case EXECUTE_ERROR_TABLE_FULL:
-                printf("Error: Table full\n");
-                break;
-            case EXECUTE_ERROR_DUPLICATE_KEY:
-                printf("Error: Duplicate key\n");
-                break;
+        if (result == TOUCHSTONE_DONE) {
+            printf("Done\n");
+        } else {
+            printf("Error: ");
+            print_statement_error(result, input->buffer);
         }
     }
 }
@@ -4,6 +4,8 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
 #include "repl.h"
 
 InputBuffer *new_input_buffer() {
@@ -35,4 +37,87 @@ void read_input(InputBuffer *s) {
     }
     s->input_len = bytes_read - 1;
     s->buffer[bytes_read - 1] = '\0';
-}
\ No newline at end of file
+}
+ScriptReader *new_script_reader(FILE *file) {
+    ScriptReader *reader = malloc(sizeof(ScriptReader));
+    reader->file = file;
+    reader->data = malloc(SCRIPT_READ_BUFFER_SIZE);
+    reader->data_capacity = SCRIPT_READ_BUFFER_SIZE;
+    reader->data_len = 0;
+    reader->position = 0;
+    reader->eof = false;
+    return reader;
+}
+
+void fill_script_reader(ScriptReader *reader) {
+    // Move the unconsumed tail to the front, growing the buffer if a single line fills it
+    size_t remaining = reader->data_len - reader->position;
+    memmove(reader->data, reader->data + reader->position, remaining);
+    reader->data_len = remaining;
+    reader->position = 0;
+
+    if (reader->data_len == reader->data_capacity) {
+        reader->data_capacity *= 2;
+        reader->data = realloc(reader->data, reader->data_capacity);
+    }
+
+    // read() returns whatever a pipe has so far, so statements piped in run as they arrive
+    ssize_t bytes_read = read(fileno(reader->file), reader->data + reader->data_len,
+                              reader->data_capacity - reader->data_len);
+    if (bytes_read == -1) {
+        if (errno == EINTR) {
+            return;
+        }
+        printf("Error reading script\n");
+        exit(EXIT_FAILURE);
+    }
+    if (bytes_read == 0) {
+        reader->eof = true;
+    }
+    reader->data_len += bytes_read;
+}
+
+bool read_script_line(ScriptReader *reader, InputBuffer *input) {
+    char *line_end;
+    while (1) {
+        size_t remaining = reader->data_len - reader->position;
+        line_end = memchr(reader->data + reader->position, '\n', remaining);
+        if (line_end != NULL) {
+            break;
+        }
+        if (reader->eof) {
+            if (remaining == 0) {
+                return false;
+            }
+            // Final line without a trailing newline
+            line_end = reader->data + reader->data_len;
+            break;
+        }
+        fill_script_reader(reader);
+    }
+
+    char *line_start = reader->data + reader->position;
+    size_t line_len = line_end - line_start;
+    reader->position += line_len;
+    if (reader->position < reader->data_len) {
+        reader->position += 1;
+    }
+
+    if (line_len > 0 && line_start[line_len - 1] == '\r') {
+        line_len -= 1;
+    }
+
+    if (input->buffer_len < line_len + 1) {
+        input->buffer_len = line_len + 1;
+        input->buffer = realloc(input->buffer, input->buffer_len);
+    }
+    memcpy(input->buffer, line_start, line_len);
+    input->buffer[line_len] = '\0';
+    input->input_len = (ssize_t) line_len;
+    return true;
+}
+
+void close_script_reader(ScriptReader *reader) {
+    free(reader->data);
+    free(reader);
+}
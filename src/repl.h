@@ -5,7 +5,12 @@
 #ifndef TOUCHSTONE_REPL_H
 #define TOUCHSTONE_REPL_H
 
+#include <stdio.h>
+#include <stdbool.h>
 #include <string.h>
+#include <sys/types.h>
+
+#define SCRIPT_READ_BUFFER_SIZE (1 << 20)
 
 typedef struct {
     char *buffer;
@@ -13,6 +18,15 @@ typedef struct {
     ssize_t input_len;
 } InputBuffer;
 
+typedef struct {
+    FILE *file;
+    char *data;
+    size_t data_capacity;
+    size_t data_len;
+    size_t position;
+    bool eof;
+} ScriptReader;
+
 InputBuffer *new_input_buffer();
 
 void debug_input(InputBuffer *input);
@@ -23,4 +37,10 @@ void print_prompt();
 
 void read_input(InputBuffer *s);
 
+ScriptReader *new_script_reader(FILE *file);
+
+bool read_script_line(ScriptReader *reader, InputBuffer *input);
+
+void close_script_reader(ScriptReader *reader);
+
 #endif //TOUCHSTONE_REPL_H
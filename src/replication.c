@@ -0,0 +1,424 @@
+//
+// Created by Matthew Emerson on 2/22/22.
+//
+
+#include <memory.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "replication.h"
+#include "learned.h"
+
+uint64_t replication_now_us() {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (uint64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+bool replication_address(const char *path, struct sockaddr_un *address) {
+    if (strlen(path) >= sizeof(address->sun_path)) {
+        printf("Error: Replication socket path too long\n");
+        return false;
+    }
+    memset(address, 0, sizeof(struct sockaddr_un));
+    address->sun_family = AF_UNIX;
+    strcpy(address->sun_path, path);
+    return true;
+}
+
+bool replication_send(int fd, const void *buffer, size_t len) {
+    size_t sent = 0;
+    while (sent < len) {
+        // A follower hanging up must not kill the primary with SIGPIPE
+        ssize_t bytes_sent = send(fd, buffer + sent, len - sent, MSG_NOSIGNAL);
+        if (bytes_sent == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        sent += bytes_sent;
+    }
+    return true;
+}
+
+bool replication_recv(int fd, void *buffer, size_t len, _Atomic bool *stopping, uint32_t timeout_ms) {
+    // Polls so a blocked reader still notices when it is asked to stop; timeout_ms 0 waits indefinitely
+    size_t received = 0;
+    uint32_t waited_ms = 0;
+    while (received < len) {
+        if (stopping != NULL && atomic_load(stopping)) {
+            return false;
+        }
+        if (timeout_ms != 0 && waited_ms >= timeout_ms) {
+            return false;
+        }
+        struct pollfd pollfd = {fd, POLLIN, 0};
+        int ready = poll(&pollfd, 1, REPLICATION_RETRY_INTERVAL_MS);
+        if (ready == -1 && errno != EINTR) {
+            return false;
+        }
+        if (ready <= 0) {
+            waited_ms += REPLICATION_RETRY_INTERVAL_MS;
+            continue;
+        }
+        ssize_t bytes_read = recv(fd, buffer + received, len - received, 0);
+        if (bytes_read == 0 || (bytes_read == -1 && errno != EINTR)) {
+            return false;
+        }
+        if (bytes_read > 0) {
+            received += bytes_read;
+        }
+    }
+    return true;
+}
+
+void replication_sleep_ms(uint32_t ms) {
+    struct timespec delay = {ms / 1000, (long) (ms % 1000) * 1000000};
+    nanosleep(&delay, NULL);
+}
+
+size_t replication_collect(ReplicationPrimary *primary, void *buffer, bool full, uint64_t sent_counter,
+                           ReplicationBatch *batch) {
+    // Caller holds the table lock, so the batch is a consistent image of every page it names
+    Table *table = primary->table;
+    Pager *pager = table->pager;
+    size_t position = sizeof(ReplicationBatch);
+    batch->magic = REPLICATION_MAGIC;
+    batch->num_pages = pager->num_pages;
+    batch->root_page_num = table->root_page_num;
+    batch->page_count = 0;
+    batch->change_counter = pager->change_counter;
+    batch->collected_at = replication_now_us();
+
+    for (uint32_t i = 0; i < pager->num_pages; i++) {
+        if (!full && pager->page_changed_at[i] <= sent_counter) {
+            continue;
+        }
+        memcpy(buffer + position, &i, sizeof(uint32_t));
+        position += sizeof(uint32_t);
+        memcpy(buffer + position, get_page(pager, i), pager->page_size);
+        position += pager->page_size;
+        batch->page_count++;
+    }
+    memcpy(buffer, batch, sizeof(ReplicationBatch));
+    return position;
+}
+
+bool follower_hung_up(int fd, uint32_t timeout_ms) {
+    // Followers never send after their request, so readability here means EOF or an error
+    struct pollfd pollfd = {fd, POLLIN, 0};
+    int ready = poll(&pollfd, 1, timeout_ms);
+    return ready > 0;
+}
+
+void replication_serve_follower(ReplicationPrimary *primary, int fd) {
+    Table *table = primary->table;
+    ReplicationHello hello = {REPLICATION_MAGIC, REPLICATION_VERSION, table->pager->page_size, table->copy_on_write,
+                              table->pager->type, 0, primary->epoch};
+    ReplicationRequest request;
+    if (!replication_send(fd, &hello, sizeof(hello)) ||
+        !replication_recv(fd, &request, sizeof(request), &primary->stopping, 0)) {
+        return;
+    }
+
+    // A follower from another epoch, or a new one, catches up with a bulk transfer of every page
+    bool full = request.epoch != primary->epoch;
+    uint64_t sent_counter = full ? 0 : request.applied_counter;
+    void *buffer = malloc(sizeof(ReplicationBatch) +
+                          (size_t) TABLE_MAX_PAGES * (sizeof(uint32_t) + table->pager->page_size));
+    atomic_store(&primary->follower_connected, true);
+
+    while (1) {
+        bool stopping = atomic_load(&primary->stopping);
+        size_t len = 0;
+        ReplicationBatch batch;
+
+        table_lock(table);
+        if (full || table->pager->change_counter > sent_counter) {
+            len = replication_collect(primary, buffer, full, sent_counter, &batch);
+        }
+        table_unlock(table);
+
+        if (len > 0) {
+            if (!replication_send(fd, buffer, len)) {
+                break;
+            }
+            full = false;
+            sent_counter = batch.change_counter;
+            atomic_store(&primary->sent_counter, sent_counter);
+            atomic_fetch_add(&primary->batches_sent, 1);
+            atomic_fetch_add(&primary->pages_sent, batch.page_count);
+        }
+        // Checked after collecting so the last changes are shipped before shutting down
+        if (stopping || follower_hung_up(fd, REPLICATION_BATCH_INTERVAL_MS)) {
+            break;
+        }
+    }
+
+    atomic_store(&primary->follower_connected, false);
+    free(buffer);
+}
+
+void *replication_primary_worker(void *arg) {
+    ReplicationPrimary *primary = arg;
+    // One follower is served at a time; a reconnecting follower is picked up by the next accept
+    while (!atomic_load(&primary->stopping)) {
+        struct pollfd pollfd = {primary->listen_fd, POLLIN, 0};
+        if (poll(&pollfd, 1, REPLICATION_RETRY_INTERVAL_MS) <= 0) {
+            continue;
+        }
+        int fd = accept(primary->listen_fd, NULL, NULL);
+        if (fd == -1) {
+            continue;
+        }
+        replication_serve_follower(primary, fd);
+        close(fd);
+    }
+    return NULL;
+}
+
+ReplicationPrimary *replication_serve(Table *table, const char *path) {
+    struct sockaddr_un address;
+    if (!replication_address(path, &address)) {
+        return NULL;
+    }
+
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listen_fd == -1) {
+        printf("Error: Unable to create replication socket: %d\n", errno);
+        return NULL;
+    }
+    unlink(path);
+    if (bind(listen_fd, (struct sockaddr *) &address, sizeof(address)) == -1 || listen(listen_fd, 1) == -1) {
+        printf("Error: Unable to listen on '%s': %d\n", path, errno);
+        close(listen_fd);
+        return NULL;
+    }
+
+    ReplicationPrimary *primary = malloc(sizeof(ReplicationPrimary));
+    primary->table = table;
+    strcpy(primary->path, path);
+    primary->listen_fd = listen_fd;
+    primary->epoch = replication_now_us();
+    primary->stopping = false;
+    primary->follower_connected = false;
+    primary->sent_counter = 0;
+    primary->batches_sent = 0;
+    primary->pages_sent = 0;
+
+    pthread_create(&primary->thread, NULL, replication_primary_worker, primary);
+    return primary;
+}
+
+void replication_stop_primary(ReplicationPrimary *primary) {
+    atomic_store(&primary->stopping, true);
+    pthread_join(primary->thread, NULL);
+    close(primary->listen_fd);
+    unlink(primary->path);
+    free(primary);
+}
+
+int replication_connect(const char *path, ReplicationHello *hello, _Atomic bool *stopping) {
+    struct sockaddr_un address;
+    if (!replication_address(path, &address)) {
+        return -1;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1) {
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr *) &address, sizeof(address)) == -1 ||
+        !replication_recv(fd, hello, sizeof(ReplicationHello), stopping, REPLICATION_HELLO_TIMEOUT_MS) ||
+        hello->magic != REPLICATION_MAGIC ||
+        hello->version != REPLICATION_VERSION) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+bool replication_batch_valid(ReplicationBatch *batch, void *pages, uint32_t page_size) {
+    // Page numbers come off the wire, so every one must name a page the primary actually has
+    if (batch->num_pages > 0 && batch->root_page_num >= batch->num_pages) {
+        return false;
+    }
+    for (uint32_t i = 0; i < batch->page_count; i++) {
+        uint32_t page_num;
+        memcpy(&page_num, pages + (size_t) i * (sizeof(uint32_t) + page_size), sizeof(uint32_t));
+        if (page_num >= batch->num_pages) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool replication_wait_for_scans(ReplicationFollower *follower) {
+    // Caller holds the table lock; returns false if asked to stop before every open scan closed
+    while (follower->open_scans > 0) {
+        if (atomic_load(&follower->stopping)) {
+            return false;
+        }
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += (long) REPLICATION_RETRY_INTERVAL_MS * 1000000;
+        deadline.tv_sec += deadline.tv_nsec / 1000000000;
+        deadline.tv_nsec %= 1000000000;
+        pthread_cond_timedwait(&follower->scans_closed, &follower->table->mutex, &deadline);
+    }
+    return true;
+}
+
+bool replication_apply(ReplicationFollower *follower, ReplicationBatch *batch, void *pages) {
+    Table *table = follower->table;
+    Pager *pager = table->pager;
+    if (!replication_batch_valid(batch, pages, pager->page_size)) {
+        return false;
+    }
+
+    // Pages are overwritten in place, so a cursor left open between steps would land in a different tree
+    table_lock(table);
+    if (!replication_wait_for_scans(follower)) {
+        table_unlock(table);
+        return true;
+    }
+    for (uint32_t i = 0; i < batch->page_count; i++) {
+        void *record = pages + (size_t) i * (sizeof(uint32_t) + pager->page_size);
+        uint32_t page_num;
+        memcpy(&page_num, record, sizeof(uint32_t));
+        memcpy(get_page(pager, page_num), record + sizeof(uint32_t), pager->page_size);
+        pager_mark_dirty(pager, page_num);
+    }
+    if (batch->num_pages < pager->num_pages) {
+        // The primary vacuumed and released pages
+        pager_truncate(pager, batch->num_pages);
+    }
+    table->root_page_num = batch->root_page_num;
+    publish_root(table);
+    LearnedIndex *learned_index = table_learned_index(table);
+    if (learned_index != NULL) {
+        // Whole leaves were replaced underneath the model, so it is refit from the new tree
+        learned_index_build(learned_index, table);
+    }
+    table_unlock(table);
+
+    follower->epoch = follower->hello.epoch;
+    atomic_store(&follower->applied_counter, batch->change_counter);
+    atomic_fetch_add(&follower->batches_applied, 1);
+    atomic_fetch_add(&follower->pages_applied, batch->page_count);
+
+    uint64_t now = replication_now_us();
+    uint64_t lag = now > batch->collected_at ? now - batch->collected_at : 0;
+    atomic_store(&follower->last_lag_us, lag);
+    if (lag > atomic_load(&follower->max_lag_us)) {
+        atomic_store(&follower->max_lag_us, lag);
+    }
+    return true;
+}
+
+void replication_follow_session(ReplicationFollower *follower, void *pages) {
+    int fd = follower->fd;
+    ReplicationRequest request = {follower->epoch, atomic_load(&follower->applied_counter)};
+    if (!replication_send(fd, &request, sizeof(request))) {
+        return;
+    }
+    atomic_store(&follower->connected, true);
+
+    ReplicationBatch batch;
+    while (replication_recv(fd, &batch, sizeof(batch), &follower->stopping, 0)) {
+        if (batch.magic != REPLICATION_MAGIC || batch.page_count > TABLE_MAX_PAGES ||
+            batch.num_pages > TABLE_MAX_PAGES) {
+            printf("Error: Malformed replication batch\n");
+            break;
+        }
+        size_t len = (size_t) batch.page_count * (sizeof(uint32_t) + follower->table->pager->page_size);
+        if (!replication_recv(fd, pages, len, &follower->stopping, 0)) {
+            break;
+        }
+        if (!replication_apply(follower, &batch, pages)) {
+            printf("Error: Replication batch names a page past the end of the table\n");
+            break;
+        }
+    }
+    atomic_store(&follower->connected, false);
+}
+
+void *replication_follower_worker(void *arg) {
+    ReplicationFollower *follower = arg;
+    void *pages = malloc((size_t) TABLE_MAX_PAGES * (sizeof(uint32_t) + follower->table->pager->page_size));
+
+    while (!atomic_load(&follower->stopping)) {
+        if (follower->fd == -1) {
+            replication_sleep_ms(REPLICATION_RETRY_INTERVAL_MS);
+            follower->fd = replication_connect(follower->path, &follower->hello, &follower->stopping);
+            if (follower->fd == -1) {
+                continue;
+            }
+            if (follower->hello.page_size != follower->table->pager->page_size || follower->hello.table_type != follower->table->pager->type) {
+                printf("Error: Primary page size %d or table type no longer matches\n", follower->hello.page_size);
+                close(follower->fd);
+                follower->fd = -1;
+                break;
+            }
+            atomic_fetch_add(&follower->reconnects, 1);
+        }
+        replication_follow_session(follower, pages);
+        close(follower->fd);
+        follower->fd = -1;
+    }
+
+    free(pages);
+    return NULL;
+}
+
+ReplicationFollower *replication_follow(Table *table, const char *path, int fd, ReplicationHello *hello) {
+    // fd is already connected and its hello read, since the hello decides how the local file is opened
+    ReplicationFollower *follower = malloc(sizeof(ReplicationFollower));
+    follower->table = table;
+    strncpy(follower->path, path, REPLICATION_PATH_SIZE - 1);
+    follower->path[REPLICATION_PATH_SIZE - 1] = '\0';
+    follower->fd = fd;
+    follower->hello = *hello;
+    follower->epoch = 0;
+    follower->stopping = false;
+    follower->connected = false;
+    follower->applied_counter = 0;
+    follower->batches_applied = 0;
+    follower->pages_applied = 0;
+    follower->reconnects = 0;
+    follower->last_lag_us = 0;
+    follower->max_lag_us = 0;
+    follower->open_scans = 0;
+    pthread_cond_init(&follower->scans_closed, NULL);
+
+    pthread_create(&follower->thread, NULL, replication_follower_worker, follower);
+    return follower;
+}
+
+void replication_stop_follower(ReplicationFollower *follower) {
+    atomic_store(&follower->stopping, true);
+    pthread_join(follower->thread, NULL);
+    if (follower->fd != -1) {
+        close(follower->fd);
+    }
+    pthread_cond_destroy(&follower->scans_closed);
+    free(follower);
+}
+
+void replication_scan_opened(ReplicationFollower *follower) {
+    // Caller holds the table lock
+    follower->open_scans++;
+}
+
+void replication_scan_closed(ReplicationFollower *follower) {
+    // Caller holds the table lock
+    follower->open_scans--;
+    if (follower->open_scans == 0) {
+        pthread_cond_signal(&follower->scans_closed);
+    }
+}
@@ -0,0 +1,92 @@
+//
+// Created by Matthew Emerson on 2/22/22.
+//
+
+#ifndef TOUCHSTONE_REPLICATION_H
+#define TOUCHSTONE_REPLICATION_H
+
+#include <pthread.h>
+#include "db.h"
+
+#define REPLICATION_MAGIC               0x50525354
+#define REPLICATION_VERSION             1
+// Changes made within one interval are shipped together as a single batch
+#define REPLICATION_BATCH_INTERVAL_MS   20
+#define REPLICATION_RETRY_INTERVAL_MS   500
+// A primary that accepts but never sends its hello is given up on after this long
+#define REPLICATION_HELLO_TIMEOUT_MS    5000
+#define REPLICATION_PATH_SIZE           108
+
+// Wire messages are raw structs; primary and follower are expected to run on the same host
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t page_size;
+    uint32_t copy_on_write;
+    uint32_t table_type;
+    uint32_t reserved;
+    // Identifies one run of the primary; change counters from a different epoch are meaningless
+    uint64_t epoch;
+} ReplicationHello;
+
+typedef struct {
+    uint64_t epoch;
+    uint64_t applied_counter;
+} ReplicationRequest;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t num_pages;
+    uint32_t root_page_num;
+    // Followed by page_count records of a uint32_t page number and page_size bytes
+    uint32_t page_count;
+    uint64_t change_counter;
+    // Wall clock microseconds when the primary collected the batch
+    uint64_t collected_at;
+} ReplicationBatch;
+
+typedef struct {
+    Table *table;
+    char path[REPLICATION_PATH_SIZE];
+    int listen_fd;
+    pthread_t thread;
+    uint64_t epoch;
+    _Atomic bool stopping;
+    _Atomic bool follower_connected;
+    _Atomic uint64_t sent_counter;
+    _Atomic uint64_t batches_sent;
+    _Atomic uint64_t pages_sent;
+} ReplicationPrimary;
+
+typedef struct {
+    Table *table;
+    char path[REPLICATION_PATH_SIZE];
+    int fd;
+    ReplicationHello hello;
+    pthread_t thread;
+    // Epoch of the primary run whose changes have been applied, 0 before the first batch
+    uint64_t epoch;
+    _Atomic bool stopping;
+    _Atomic bool connected;
+    _Atomic uint64_t applied_counter;
+    _Atomic uint64_t batches_applied;
+    _Atomic uint64_t pages_applied;
+    _Atomic uint64_t reconnects;
+    _Atomic uint64_t last_lag_us;
+    _Atomic uint64_t max_lag_us;
+    // Scans with a cursor open across steps, guarded by the table lock; batches wait for them to close
+    uint32_t open_scans;
+    pthread_cond_t scans_closed;
+} ReplicationFollower;
+
+ReplicationPrimary *replication_serve(Table *table, const char *path);
+void replication_stop_primary(ReplicationPrimary *primary);
+
+int replication_connect(const char *path, ReplicationHello *hello, _Atomic bool *stopping);
+ReplicationFollower *replication_follow(Table *table, const char *path, int fd, ReplicationHello *hello);
+void replication_stop_follower(ReplicationFollower *follower);
+void replication_scan_opened(ReplicationFollower *follower);
+void replication_scan_closed(ReplicationFollower *follower);
+
+#endif //TOUCHSTONE_REPLICATION_H
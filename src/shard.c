@@ -0,0 +1,283 @@
+//
+// Created by Matthew Emerson on 2/18/22.
+//
+
+#include <stdio.h>
+#include <string.h>
+#include "shard.h"
+
+void *shard_worker(void *arg) {
+    Shard *shard = arg;
+    Row batch[SHARD_BATCH_SIZE];
+
+    pthread_mutex_lock(&shard->mutex);
+    while (1) {
+        while (shard->queue_len == 0 && !shard->stopping) {
+            pthread_cond_wait(&shard->not_empty, &shard->mutex);
+        }
+        if (shard->queue_len == 0) {
+            break;
+        }
+
+        uint32_t batch_len = 0;
+        while (batch_len < SHARD_BATCH_SIZE && shard->queue_len > 0) {
+            batch[batch_len++] = shard->queue[shard->queue_head];
+            shard->queue_head = (shard->queue_head + 1) % SHARD_QUEUE_SIZE;
+            shard->queue_len--;
+        }
+        shard->busy = true;
+        pthread_cond_broadcast(&shard->not_full);
+        pthread_mutex_unlock(&shard->mutex);
+
+        // Only this thread writes the shard's tree, so the batch is applied without holding the lock
+        uint32_t inserted = 0;
+        ExecuteResult first_error = EXECUTE_SUCCESS;
+        for (uint32_t i = 0; i < batch_len; i++) {
+            ExecuteResult result = table_insert(shard->table, &batch[i]);
+            if (result == EXECUTE_SUCCESS) {
+                inserted++;
+            } else if (first_error == EXECUTE_SUCCESS) {
+                first_error = result;
+            }
+        }
+
+        pthread_mutex_lock(&shard->mutex);
+        shard->rows_inserted += inserted;
+        shard->rows_rejected += batch_len - inserted;
+        if (shard->unreported_errors == 0) {
+            shard->first_unreported_error = first_error;
+        }
+        shard->unreported_errors += batch_len - inserted;
+        shard->busy = false;
+        pthread_cond_broadcast(&shard->idle);
+    }
+    pthread_mutex_unlock(&shard->mutex);
+    return NULL;
+}
+
+void shard_filename(char *destination, const char *filename, uint32_t shard_num) {
+    snprintf(destination, SHARD_FILENAME_SIZE, "%s.%d", filename, shard_num);
+}
+
+bool read_shard_manifest(const char *filename, uint32_t *num_shards, uint32_t *key_span, bool *found) {
+    // Returns false only for a manifest that exists but cannot be used
+    FILE *manifest = fopen(filename, "r");
+    *found = manifest != NULL;
+    if (manifest == NULL) {
+        return true;
+    }
+    int matched = fscanf(manifest, SHARD_MANIFEST_MAGIC " %u %u", num_shards, key_span);
+    fclose(manifest);
+    if (matched != 2 || *num_shards == 0 || *num_shards > SHARD_MAX_COUNT || *key_span == 0) {
+        printf("Error: '%s' is not a shard manifest\n", filename);
+        return false;
+    }
+    return true;
+}
+
+bool write_shard_manifest(const char *filename, uint32_t num_shards, uint32_t key_span) {
+    FILE *manifest = fopen(filename, "w");
+    if (manifest == NULL) {
+        printf("Error: Unable to write shard manifest '%s'\n", filename);
+        return false;
+    }
+    fprintf(manifest, SHARD_MANIFEST_MAGIC " %u %u\n", num_shards, key_span);
+    fclose(manifest);
+    return true;
+}
+
+ShardedTable *open_sharded_db(const char *filename, uint32_t num_shards, uint32_t key_span, uint32_t page_size) {
+    // The manifest fixes the key ranges, so an existing one wins over the requested layout; NULL on failure
+    bool found;
+    if (!read_shard_manifest(filename, &num_shards, &key_span, &found)) {
+        return NULL;
+    }
+    if (!found) {
+        if (num_shards == 0 || num_shards > SHARD_MAX_COUNT) {
+            printf("Error: Shard count must be from 1 to %d\n", SHARD_MAX_COUNT);
+            return NULL;
+        }
+        if (key_span == 0) {
+            // Split the whole id space evenly
+            key_span = (uint32_t) (((uint64_t) INT32_MAX + num_shards) / num_shards);
+        }
+        if (!write_shard_manifest(filename, num_shards, key_span)) {
+            return NULL;
+        }
+    }
+
+    ShardedTable *sharded = malloc(sizeof(ShardedTable));
+    if (sharded == NULL) {
+        return NULL;
+    }
+    sharded->num_shards = 0;
+    sharded->key_span = key_span;
+
+    char shard_path[SHARD_FILENAME_SIZE];
+    for (uint32_t i = 0; i < num_shards; i++) {
+        Shard *shard = &sharded->shards[i];
+        shard_filename(shard_path, filename, i);
+        shard->table = open_db(shard_path, page_size, TABLE_BTREE);
+        if (shard->table == NULL) {
+            // Stops and closes the shards opened so far
+            close_sharded_db(sharded);
+            return NULL;
+        }
+        pthread_mutex_init(&shard->mutex, NULL);
+        pthread_cond_init(&shard->not_empty, NULL);
+        pthread_cond_init(&shard->not_full, NULL);
+        pthread_cond_init(&shard->idle, NULL);
+        shard->queue_head = 0;
+        shard->queue_len = 0;
+        shard->busy = false;
+        shard->stopping = false;
+        shard->rows_inserted = 0;
+        shard->rows_rejected = 0;
+        shard->unreported_errors = 0;
+        shard->first_unreported_error = EXECUTE_SUCCESS;
+        int error = pthread_create(&shard->thread, NULL, shard_worker, shard);
+        if (error != 0) {
+            // Inserts queued to a shard with no worker would never run, and syncing would wait forever
+            printf("Error: Unable to start shard %d worker: %d\n", i, error);
+            close_db(shard->table);
+            pthread_mutex_destroy(&shard->mutex);
+            pthread_cond_destroy(&shard->not_empty);
+            pthread_cond_destroy(&shard->not_full);
+            pthread_cond_destroy(&shard->idle);
+            close_sharded_db(sharded);
+            return NULL;
+        }
+        sharded->num_shards = i + 1;
+    }
+
+    return sharded;
+}
+
+void close_sharded_db(ShardedTable *sharded) {
+    for (uint32_t i = 0; i < sharded->num_shards; i++) {
+        Shard *shard = &sharded->shards[i];
+        pthread_mutex_lock(&shard->mutex);
+        shard->stopping = true;
+        pthread_cond_signal(&shard->not_empty);
+        pthread_mutex_unlock(&shard->mutex);
+    }
+
+    for (uint32_t i = 0; i < sharded->num_shards; i++) {
+        Shard *shard = &sharded->shards[i];
+        pthread_join(shard->thread, NULL);
+        close_db(shard->table);
+        pthread_mutex_destroy(&shard->mutex);
+        pthread_cond_destroy(&shard->not_empty);
+        pthread_cond_destroy(&shard->not_full);
+        pthread_cond_destroy(&shard->idle);
+    }
+    free(sharded);
+}
+
+uint32_t shard_for_key(ShardedTable *sharded, uint32_t key) {
+    uint32_t shard_num = key / sharded->key_span;
+    if (shard_num >= sharded->num_shards) {
+        shard_num = sharded->num_shards - 1;
+    }
+    return shard_num;
+}
+
+void sharded_insert(ShardedTable *sharded, Row *row) {
+    // Inserts are queued to the owning worker; failures such as duplicates come back from sharded_take_errors()
+    Shard *shard = &sharded->shards[shard_for_key(sharded, row->id)];
+
+    pthread_mutex_lock(&shard->mutex);
+    while (shard->queue_len == SHARD_QUEUE_SIZE) {
+        pthread_cond_wait(&shard->not_full, &shard->mutex);
+    }
+    shard->queue[(shard->queue_head + shard->queue_len) % SHARD_QUEUE_SIZE] = *row;
+    shard->queue_len++;
+    pthread_cond_signal(&shard->not_empty);
+    pthread_mutex_unlock(&shard->mutex);
+}
+
+void shard_wait_idle(Shard *shard) {
+    // Returns with the mutex held, so the worker cannot start another batch
+    pthread_mutex_lock(&shard->mutex);
+    while (shard->queue_len > 0 || shard->busy) {
+        pthread_cond_wait(&shard->idle, &shard->mutex);
+    }
+}
+
+void sharded_sync(ShardedTable *sharded) {
+    for (uint32_t i = 0; i < sharded->num_shards; i++) {
+        shard_wait_idle(&sharded->shards[i]);
+        pthread_mutex_unlock(&sharded->shards[i].mutex);
+    }
+}
+
+uint32_t sharded_take_errors(ShardedTable *sharded, ExecuteResult *first_error) {
+    // Waits for every queued insert, then returns how many failed since the last call
+    uint32_t num_errors = 0;
+    *first_error = EXECUTE_SUCCESS;
+    for (uint32_t i = 0; i < sharded->num_shards; i++) {
+        Shard *shard = &sharded->shards[i];
+        shard_wait_idle(shard);
+        if (shard->unreported_errors > 0) {
+            if (num_errors == 0) {
+                *first_error = shard->first_unreported_error;
+            }
+            num_errors += shard->unreported_errors;
+            shard->unreported_errors = 0;
+        }
+        pthread_mutex_unlock(&shard->mutex);
+    }
+    return num_errors;
+}
+
+void sharded_commit(ShardedTable *sharded) {
+    for (uint32_t i = 0; i < sharded->num_shards; i++) {
+        Shard *shard = &sharded->shards[i];
+        shard_wait_idle(shard);
+        commit_db(shard->table);
+        pthread_mutex_unlock(&shard->mutex);
+    }
+}
+
+bool sharded_lookup(ShardedTable *sharded, uint32_t key, Row *row) {
+    Shard *shard = &sharded->shards[shard_for_key(sharded, key)];
+    shard_wait_idle(shard);
+    bool found = table_lookup(shard->table, key, row);
+    pthread_mutex_unlock(&shard->mutex);
+    return found;
+}
+
+ShardScan *shard_scan_start(ShardedTable *sharded) {
+    // Scans see every insert queued before they started; the caller must not insert while scanning
+    sharded_sync(sharded);
+
+    ShardScan *scan = malloc(sizeof(ShardScan));
+    scan->sharded = sharded;
+    for (uint32_t i = 0; i < sharded->num_shards; i++) {
+        scan->cursors[i] = table_start(sharded->shards[i].table);
+    }
+    scan->current = 0;
+    return scan;
+}
+
+bool shard_scan_next(ShardScan *scan, Row *row) {
+    // Every key in shard i sorts before every key in shard i + 1, so key order needs no merge
+    while (scan->current < scan->sharded->num_shards && scan->cursors[scan->current]->end_of_table) {
+        scan->current++;
+    }
+    if (scan->current == scan->sharded->num_shards) {
+        return false;
+    }
+
+    Cursor *cursor = scan->cursors[scan->current];
+    deserialize_row(cursor_ptr(cursor), row);
+    cursor_advance(cursor);
+    return true;
+}
+
+void close_shard_scan(ShardScan *scan) {
+    for (uint32_t i = 0; i < scan->sharded->num_shards; i++) {
+        free(scan->cursors[i]);
+    }
+    free(scan);
+}
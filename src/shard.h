@@ -0,0 +1,64 @@
+//
+// Created by Matthew Emerson on 2/18/22.
+//
+
+#ifndef TOUCHSTONE_SHARD_H
+#define TOUCHSTONE_SHARD_H
+
+#include <pthread.h>
+#include "db.h"
+
+#define SHARD_MAX_COUNT         16
+#define SHARD_QUEUE_SIZE        4096
+#define SHARD_BATCH_SIZE        256
+#define SHARD_MANIFEST_MAGIC    "touchstone shards"
+#define SHARD_FILENAME_SIZE     4096
+
+typedef struct {
+    Table *table;
+    pthread_t thread;
+    // Guards the queue and counters; the worker only touches the table while busy
+    pthread_mutex_t mutex;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+    pthread_cond_t idle;
+    Row queue[SHARD_QUEUE_SIZE];
+    uint32_t queue_head;
+    uint32_t queue_len;
+    bool busy;
+    bool stopping;
+    uint64_t rows_inserted;
+    uint64_t rows_rejected;
+    // Failed inserts not yet handed to the caller by sharded_take_errors(), and the first one's result
+    uint32_t unreported_errors;
+    ExecuteResult first_unreported_error;
+} Shard;
+
+typedef struct {
+    Shard shards[SHARD_MAX_COUNT];
+    uint32_t num_shards;
+    // Shard i owns keys [i * key_span, (i + 1) * key_span)
+    uint32_t key_span;
+} ShardedTable;
+
+typedef struct {
+    ShardedTable *sharded;
+    Cursor *cursors[SHARD_MAX_COUNT];
+    // Shards own ascending key ranges, so a scan reads them one after another
+    uint32_t current;
+} ShardScan;
+
+ShardedTable *open_sharded_db(const char *filename, uint32_t num_shards, uint32_t key_span, uint32_t page_size);
+void close_sharded_db(ShardedTable *sharded);
+uint32_t shard_for_key(ShardedTable *sharded, uint32_t key);
+void sharded_insert(ShardedTable *sharded, Row *row);
+void sharded_sync(ShardedTable *sharded);
+uint32_t sharded_take_errors(ShardedTable *sharded, ExecuteResult *first_error);
+void sharded_commit(ShardedTable *sharded);
+bool sharded_lookup(ShardedTable *sharded, uint32_t key, Row *row);
+
+ShardScan *shard_scan_start(ShardedTable *sharded);
+bool shard_scan_next(ShardScan *scan, Row *row);
+void close_shard_scan(ShardScan *scan);
+
+#endif //TOUCHSTONE_SHARD_H
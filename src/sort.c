@@ -0,0 +1,271 @@
+//
+// Created by Matthew Emerson on 2/12/22.
+//
+
+// qsort_r
+#define _GNU_SOURCE
+#include <string.h>
+#include <errno.h>
+#include "sort.h"
+
+int compare_rows(Row *a, Row *b, Column column, bool descending) {
+    int result = 0;
+    switch (column) {
+        case COLUMN_ID:
+            result = (a->id > b->id) - (a->id < b->id);
+            break;
+        case COLUMN_USERNAME:
+            result = strncmp(a->username, b->username, COLUMN_USERNAME_SIZE);
+            break;
+        case COLUMN_EMAIL:
+            result = strncmp(a->email, b->email, COLUMN_EMAIL_SIZE);
+            break;
+    }
+    if (descending) {
+        result = -result;
+    }
+    // Fall back to the key so equal values come out in a stable order
+    if (result == 0) {
+        result = (a->id > b->id) - (a->id < b->id);
+    }
+    return result;
+}
+
+int qsort_compare(const void *a, const void *b, void *context) {
+    Sorter *sorter = context;
+    return compare_rows((Row *) a, (Row *) b, sorter->column, sorter->descending);
+}
+
+void sort_rows(Sorter *sorter) {
+    qsort_r(sorter->rows, sorter->num_rows, sizeof(Row), qsort_compare, sorter);
+}
+
+void sort_grow(Sorter *sorter) {
+    // Memory is taken as rows arrive, doubling up to the budget, so small sorts stay small
+    uint32_t capacity = sorter->capacity * 2;
+    if (capacity > sorter->max_rows) {
+        capacity = sorter->max_rows;
+    }
+    Row *rows = realloc(sorter->rows, capacity * sizeof(Row));
+    if (rows == NULL) {
+        printf("Error: Unable to grow sort buffer to %d rows\n", capacity);
+        exit(EXIT_FAILURE);
+    }
+    sorter->rows = rows;
+    sorter->capacity = capacity;
+}
+
+Sorter *new_sorter(Column column, bool descending, uint32_t limit, size_t memory_budget) {
+    Sorter *sorter = malloc(sizeof(Sorter));
+    sorter->column = column;
+    sorter->descending = descending;
+    sorter->limit = limit;
+    sorter->max_rows = memory_budget / sizeof(Row);
+    if (sorter->max_rows < 2) {
+        sorter->max_rows = 2;
+    }
+    // A limit that fits in memory only ever needs the best k rows seen so far
+    sorter->top_k = limit > 0 && limit <= sorter->max_rows;
+    if (sorter->top_k) {
+        sorter->max_rows = limit;
+    }
+    sorter->capacity = sorter->max_rows < SORT_INITIAL_ROWS ? sorter->max_rows : SORT_INITIAL_ROWS;
+    sorter->rows = malloc(sorter->capacity * sizeof(Row));
+    sorter->num_rows = 0;
+    sorter->num_runs = 0;
+    sorter->position = 0;
+    sorter->emitted = 0;
+    return sorter;
+}
+
+void heap_sift_down(Sorter *sorter, uint32_t index) {
+    // Max-heap in sort order: the root is the row that would be emitted last
+    Row *rows = sorter->rows;
+    while (1) {
+        uint32_t largest = index;
+        uint32_t left = 2 * index + 1;
+        uint32_t right = left + 1;
+        if (left < sorter->num_rows &&
+            compare_rows(&rows[left], &rows[largest], sorter->column, sorter->descending) > 0) {
+            largest = left;
+        }
+        if (right < sorter->num_rows &&
+            compare_rows(&rows[right], &rows[largest], sorter->column, sorter->descending) > 0) {
+            largest = right;
+        }
+        if (largest == index) {
+            return;
+        }
+        Row swap = rows[index];
+        rows[index] = rows[largest];
+        rows[largest] = swap;
+        index = largest;
+    }
+}
+
+void heap_sift_up(Sorter *sorter, uint32_t index) {
+    Row *rows = sorter->rows;
+    while (index > 0) {
+        uint32_t parent = (index - 1) / 2;
+        if (compare_rows(&rows[index], &rows[parent], sorter->column, sorter->descending) <= 0) {
+            return;
+        }
+        Row swap = rows[index];
+        rows[index] = rows[parent];
+        rows[parent] = swap;
+        index = parent;
+    }
+}
+
+bool sort_run_read(SortRun *run) {
+    run->has_head = fread(&run->head, sizeof(Row), 1, run->file) == 1;
+    return run->has_head;
+}
+
+FILE *new_run_file() {
+    FILE *file = tmpfile();
+    if (file == NULL) {
+        printf("Error: Unable to create sort run file: %d\n", errno);
+        exit(EXIT_FAILURE);
+    }
+    return file;
+}
+
+SortRun *sort_next_run(Sorter *sorter, SortRun *runs, uint32_t num_runs) {
+    SortRun *best = NULL;
+    for (uint32_t i = 0; i < num_runs; i++) {
+        if (runs[i].has_head &&
+            (best == NULL || compare_rows(&runs[i].head, &best->head, sorter->column, sorter->descending) < 0)) {
+            best = &runs[i];
+        }
+    }
+    return best;
+}
+
+void sort_rewind_runs(SortRun *runs, uint32_t num_runs) {
+    for (uint32_t i = 0; i < num_runs; i++) {
+        rewind(runs[i].file);
+        sort_run_read(&runs[i]);
+    }
+}
+
+void sort_merge_runs(Sorter *sorter, uint32_t first) {
+    // Folds runs[first..] into one run a level above the highest of them
+    SortRun *runs = sorter->runs + first;
+    uint32_t num_runs = sorter->num_runs - first;
+    FILE *merged = new_run_file();
+    sort_rewind_runs(runs, num_runs);
+
+    SortRun *run;
+    while ((run = sort_next_run(sorter, runs, num_runs)) != NULL) {
+        if (fwrite(&run->head, sizeof(Row), 1, merged) != 1) {
+            printf("Error: Unable to write sort run: %d\n", errno);
+            exit(EXIT_FAILURE);
+        }
+        sort_run_read(run);
+    }
+
+    for (uint32_t i = 0; i < num_runs; i++) {
+        fclose(runs[i].file);
+    }
+    runs[0].file = merged;
+    runs[0].level++;
+    sorter->num_runs = first + 1;
+}
+
+void sort_cascade_runs(Sorter *sorter) {
+    // Like carrying in a base SORT_MERGE_FAN_IN counter: a level that fills up becomes one run of the next
+    while (sorter->num_runs >= SORT_MERGE_FAN_IN) {
+        uint32_t first = sorter->num_runs - SORT_MERGE_FAN_IN;
+        if (sorter->runs[first].level != sorter->runs[sorter->num_runs - 1].level) {
+            return;
+        }
+        sort_merge_runs(sorter, first);
+    }
+}
+
+void sort_spill(Sorter *sorter) {
+    if (sorter->num_runs == SORT_MAX_MERGE_WIDTH) {
+        // Only reachable past SORT_MAX_MERGE_WIDTH / (SORT_MERGE_FAN_IN - 1) levels
+        sort_merge_runs(sorter, sorter->num_runs - SORT_MERGE_FAN_IN);
+    }
+
+    sort_rows(sorter);
+    FILE *file = new_run_file();
+    if (fwrite(sorter->rows, sizeof(Row), sorter->num_rows, file) != sorter->num_rows) {
+        printf("Error: Unable to write sort run: %d\n", errno);
+        exit(EXIT_FAILURE);
+    }
+    sorter->runs[sorter->num_runs].file = file;
+    sorter->runs[sorter->num_runs].level = 0;
+    sorter->num_runs++;
+    sorter->num_rows = 0;
+    sort_cascade_runs(sorter);
+}
+
+void sorter_add(Sorter *sorter, Row *row) {
+    if (sorter->top_k) {
+        if (sorter->num_rows < sorter->max_rows) {
+            if (sorter->num_rows == sorter->capacity) {
+                sort_grow(sorter);
+            }
+            sorter->rows[sorter->num_rows] = *row;
+            heap_sift_up(sorter, sorter->num_rows);
+            sorter->num_rows++;
+        } else if (compare_rows(row, &sorter->rows[0], sorter->column, sorter->descending) < 0) {
+            sorter->rows[0] = *row;
+            heap_sift_down(sorter, 0);
+        }
+        return;
+    }
+
+    if (sorter->num_rows == sorter->max_rows) {
+        sort_spill(sorter);
+    } else if (sorter->num_rows == sorter->capacity) {
+        sort_grow(sorter);
+    }
+    sorter->rows[sorter->num_rows++] = *row;
+}
+
+void sorter_finish(Sorter *sorter) {
+    if (sorter->num_runs == 0) {
+        sort_rows(sorter);
+        return;
+    }
+
+    if (sorter->num_rows > 0) {
+        sort_spill(sorter);
+    }
+    sort_rewind_runs(sorter->runs, sorter->num_runs);
+}
+
+bool sorter_next(Sorter *sorter, Row *row) {
+    if (sorter->limit > 0 && sorter->emitted == sorter->limit) {
+        return false;
+    }
+
+    if (sorter->num_runs == 0) {
+        if (sorter->position == sorter->num_rows) {
+            return false;
+        }
+        *row = sorter->rows[sorter->position++];
+    } else {
+        SortRun *run = sort_next_run(sorter, sorter->runs, sorter->num_runs);
+        if (run == NULL) {
+            return false;
+        }
+        *row = run->head;
+        sort_run_read(run);
+    }
+
+    sorter->emitted++;
+    return true;
+}
+
+void close_sorter(Sorter *sorter) {
+    for (uint32_t i = 0; i < sorter->num_runs; i++) {
+        fclose(sorter->runs[i].file);
+    }
+    free(sorter->rows);
+    free(sorter);
+}
@@ -0,0 +1,50 @@
+//
+// Created by Matthew Emerson on 2/12/22.
+//
+
+#ifndef TOUCHSTONE_SORT_H
+#define TOUCHSTONE_SORT_H
+
+#include <stdio.h>
+#include "db.h"
+
+#define SORT_DEFAULT_MEMORY_BUDGET  (16 * 1024 * 1024)
+#define SORT_MAX_MERGE_WIDTH        64
+// Runs merged at once while spilling: each level holds fewer than this many, so each row is rewritten once per level
+#define SORT_MERGE_FAN_IN           8
+#define SORT_INITIAL_ROWS           64
+
+typedef struct {
+    FILE *file;
+    Row head;
+    bool has_head;
+    // Merges the run's rows have been through; levels never increase toward the end of Sorter.runs
+    uint32_t level;
+} SortRun;
+
+typedef struct {
+    Column column;
+    bool descending;
+    uint32_t limit;
+    // In-memory rows: a bounded max-heap for top-k, otherwise the run being built
+    Row *rows;
+    uint32_t num_rows;
+    // Rows allocated so far, grown toward max_rows, the most the memory budget allows
+    uint32_t capacity;
+    uint32_t max_rows;
+    bool top_k;
+    SortRun runs[SORT_MAX_MERGE_WIDTH];
+    uint32_t num_runs;
+    uint32_t position;
+    uint32_t emitted;
+} Sorter;
+
+int compare_rows(Row *a, Row *b, Column column, bool descending);
+
+Sorter *new_sorter(Column column, bool descending, uint32_t limit, size_t memory_budget);
+void sorter_add(Sorter *sorter, Row *row);
+void sorter_finish(Sorter *sorter);
+bool sorter_next(Sorter *sorter, Row *row);
+void close_sorter(Sorter *sorter);
+
+#endif //TOUCHSTONE_SORT_H
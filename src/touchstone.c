@@ -0,0 +1,492 @@
+//
+// Created by Matthew Emerson on 2/8/22.
+//
+
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include "touchstone.h"
+#include "compiler.h"
+#include "copy.h"
+
+TouchstoneResult touchstone_open(const char *filename, TouchstoneDb **db) {
+    return touchstone_open_with_page_size(filename, 0, db);
+}
+
+TouchstoneResult touchstone_open_with_page_size(const char *filename, uint32_t page_size, TouchstoneDb **db) {
+    return touchstone_open_with_type(filename, page_size, TABLE_BTREE, db);
+}
+
+TouchstoneResult touchstone_open_with_type(const char *filename, uint32_t page_size, TableType type,
+                                           TouchstoneDb **db) {
+    // page_size and type only apply when creating a file; existing files keep theirs from the header
+    *db = NULL;
+    TouchstoneDb *handle = malloc(sizeof(TouchstoneDb));
+    if (handle == NULL) {
+        return TOUCHSTONE_ERROR_IO;
+    }
+    handle->table = open_db(filename, page_size, type);
+    if (handle->table == NULL) {
+        free(handle);
+        return TOUCHSTONE_ERROR_IO;
+    }
+    handle->sharded = NULL;
+    handle->backup = NULL;
+    handle->primary = NULL;
+    handle->follower = NULL;
+    handle->tracer = NULL;
+    *db = handle;
+    return TOUCHSTONE_OK;
+}
+
+TouchstoneResult touchstone_open_sharded(const char *filename, uint32_t num_shards, uint32_t key_span,
+                                         uint32_t page_size, TouchstoneDb **db) {
+    *db = NULL;
+    TouchstoneDb *handle = malloc(sizeof(TouchstoneDb));
+    if (handle == NULL) {
+        return TOUCHSTONE_ERROR_IO;
+    }
+    handle->table = NULL;
+    handle->sharded = open_sharded_db(filename, num_shards, key_span, page_size);
+    if (handle->sharded == NULL) {
+        free(handle);
+        return TOUCHSTONE_ERROR_IO;
+    }
+    handle->backup = NULL;
+    handle->primary = NULL;
+    handle->follower = NULL;
+    handle->tracer = NULL;
+    *db = handle;
+    return TOUCHSTONE_OK;
+}
+
+TouchstoneResult touchstone_open_follower(const char *filename, const char *socket_path, TouchstoneDb **db) {
+    // The primary's hello decides the page size, so it is read before the local file is opened
+    ReplicationHello hello;
+    int fd = replication_connect(socket_path, &hello, NULL);
+    if (fd == -1) {
+        *db = NULL;
+        return TOUCHSTONE_ERROR_IO;
+    }
+
+    if (touchstone_open_with_type(filename, hello.page_size, hello.table_type, db) != TOUCHSTONE_OK) {
+        close(fd);
+        return TOUCHSTONE_ERROR_IO;
+    }
+    Table *table = (*db)->table;
+    if (table->pager->page_size != hello.page_size || table->pager->type != hello.table_type) {
+        printf("Error: Primary page size %d or table type does not match the local file\n", hello.page_size);
+        close(fd);
+        touchstone_close(*db);
+        *db = NULL;
+        return TOUCHSTONE_ERROR_IO;
+    }
+    // Cursors must walk the primary's tree the same way it does
+    table->copy_on_write = hello.copy_on_write;
+    (*db)->follower = replication_follow(table, socket_path, fd, &hello);
+    return TOUCHSTONE_OK;
+}
+
+void touchstone_close(TouchstoneDb *db) {
+    if (db->backup != NULL) {
+        backup_finish(db->backup);
+    }
+    if (db->primary != NULL) {
+        replication_stop_primary(db->primary);
+    }
+    if (db->follower != NULL) {
+        replication_stop_follower(db->follower);
+    }
+    if (db->sharded != NULL) {
+        close_sharded_db(db->sharded);
+    } else {
+        close_db(db->table);
+    }
+    // Closed last so the final flushes are traced
+    if (db->tracer != NULL) {
+        close_tracer(db->tracer);
+    }
+    free(db);
+}
+
+void touchstone_commit(TouchstoneDb *db) {
+    if (db->sharded != NULL) {
+        sharded_commit(db->sharded);
+    } else {
+        table_lock(db->table);
+        commit_db(db->table);
+        table_unlock(db->table);
+    }
+}
+
+void touchstone_set_sort_memory(TouchstoneDb *db, size_t memory_budget) {
+    if (db->sharded == NULL) {
+        db->table->sort_memory_budget = memory_budget;
+        return;
+    }
+    for (uint32_t i = 0; i < db->sharded->num_shards; i++) {
+        db->sharded->shards[i].table->sort_memory_budget = memory_budget;
+    }
+}
+
+Table *touchstone_table(TouchstoneDb *db) {
+    // NULL for sharded databases, which have one table per shard
+    return db->table;
+}
+
+TouchstoneResult touchstone_backup(TouchstoneDb *db, const char *path, uint64_t bytes_per_sec) {
+    // Copies the database to path on a background thread while statements keep running
+    if (db->sharded != NULL || (db->backup != NULL && !backup_done(db->backup))) {
+        return TOUCHSTONE_ERROR_MISUSE;
+    }
+    if (db->backup != NULL) {
+        backup_finish(db->backup);
+    }
+    db->backup = backup_start(db->table, path, bytes_per_sec);
+    return db->backup != NULL ? TOUCHSTONE_OK : TOUCHSTONE_ERROR_IO;
+}
+
+TouchstoneResult touchstone_replicate(TouchstoneDb *db, const char *socket_path) {
+    // Ships changed pages to a follower connecting on socket_path
+    if (db->sharded != NULL || db->follower != NULL || db->primary != NULL) {
+        return TOUCHSTONE_ERROR_MISUSE;
+    }
+    db->primary = replication_serve(db->table, socket_path);
+    return db->primary != NULL ? TOUCHSTONE_OK : TOUCHSTONE_ERROR_IO;
+}
+
+TouchstoneResult touchstone_trace(TouchstoneDb *db, const char *path) {
+    // Records page accesses from every pager, tagging each with its shard number
+    if (db->tracer != NULL) {
+        return TOUCHSTONE_ERROR_MISUSE;
+    }
+    db->tracer = new_tracer(path);
+    if (db->tracer == NULL) {
+        return TOUCHSTONE_ERROR_IO;
+    }
+
+    if (db->sharded == NULL) {
+        db->table->pager->tracer = db->tracer;
+        return TOUCHSTONE_OK;
+    }
+    for (uint32_t i = 0; i < db->sharded->num_shards; i++) {
+        Pager *pager = db->sharded->shards[i].table->pager;
+        pager->trace_source = i;
+        pager->tracer = db->tracer;
+    }
+    return TOUCHSTONE_OK;
+}
+
+TouchstoneResult prepare_result_to_touchstone(PrepareResult result) {
+    switch (result) {
+        case PREPARE_SUCCESS:
+            return TOUCHSTONE_OK;
+        case PREPARE_ERROR_NOT_FOUND:
+            return TOUCHSTONE_ERROR_UNRECOGNIZED;
+        case PREPARE_ERROR_SYNTAX:
+            return TOUCHSTONE_ERROR_SYNTAX;
+        case PREPARE_ERROR_OUT_OF_BOUNDS:
+            return TOUCHSTONE_ERROR_OUT_OF_BOUNDS;
+    }    return TOUCHSTONE_ERROR_MISUSE;
+}
+
+TouchstoneResult execute_result_to_touchstone(ExecuteResult result) {
+    switch (result) {
+        case EXECUTE_SUCCESS:
+            return TOUCHSTONE_DONE;
+        case EXECUTE_ERROR_TABLE_FULL:
+            return TOUCHSTONE_ERROR_TABLE_FULL;
+        case EXECUTE_ERROR_DUPLICATE_KEY:
+            return TOUCHSTONE_ERROR_DUPLICATE_KEY;
+        case EXECUTE_ERROR_IO:
+            return TOUCHSTONE_ERROR_IO;
+        case EXECUTE_ERROR_UNSUPPORTED:
+            return TOUCHSTONE_ERROR_UNSUPPORTED;
+    }    return TOUCHSTONE_ERROR_MISUSE;
+}
+
+TouchstoneResult touchstone_sync(TouchstoneDb *db, uint32_t *num_failed) {
+    // Sharded inserts step to TOUCHSTONE_DONE once queued; this waits for them and reports the ones that failed
+    *num_failed = 0;
+    if (db->sharded == NULL) {
+        return TOUCHSTONE_OK;
+    }
+    ExecuteResult first_error;
+    *num_failed = sharded_take_errors(db->sharded, &first_error);
+    return *num_failed == 0 ? TOUCHSTONE_OK : execute_result_to_touchstone(first_error);
+}
+
+TouchstoneResult touchstone_prepare(TouchstoneDb *db, const char *sql, TouchstoneStmt **stmt) {
+    // The compiler tokenizes in place, so give it a private copy of the text
+    InputBuffer input;
+    input.input_len = (ssize_t) strlen(sql);
+    input.buffer_len = input.input_len + 1;
+    input.buffer = malloc(input.buffer_len);
+    memcpy(input.buffer, sql, input.buffer_len);
+
+    TouchstoneStmt *handle = malloc(sizeof(TouchstoneStmt));
+    PrepareResult result = prepare_statement(&input, &handle->statement);
+    free(input.buffer);
+
+    if (result != PREPARE_SUCCESS) {
+        free(handle);
+        *stmt = NULL;
+        return prepare_result_to_touchstone(result);
+    }
+
+    handle->db = db;
+    handle->bound_columns = 0;
+    handle->cursor = NULL;
+    handle->shard_scan = NULL;
+    handle->sorter = NULL;
+    handle->rows_returned = 0;
+    handle->done = false;
+    *stmt = handle;
+    return TOUCHSTONE_OK;
+}
+
+Column param_column(TouchstoneStmt *stmt, uint32_t index, bool *found) {
+    // Parameters are numbered from 1 in column order
+    uint32_t position = 0;
+    for (Column column = COLUMN_ID; column <= COLUMN_EMAIL; column++) {
+        if (stmt->statement.param_columns & (1 << column)) {
+            position++;
+            if (position == index) {
+                *found = true;
+                return column;
+            }
+        }
+    }
+    *found = false;
+    return COLUMN_ID;
+}
+
+TouchstoneResult touchstone_bind_int(TouchstoneStmt *stmt, uint32_t index, uint32_t value) {
+    bool found;
+    Column column = param_column(stmt, index, &found);
+    if (!found || column != COLUMN_ID) {
+        return TOUCHSTONE_ERROR_MISUSE;
+    }
+    if (value > INT32_MAX) {
+        return TOUCHSTONE_ERROR_OUT_OF_BOUNDS;
+    }
+
+    stmt->statement.row_to_insert.id = value;
+    stmt->bound_columns |= 1 << column;
+    return TOUCHSTONE_OK;
+}
+
+TouchstoneResult touchstone_bind_text(TouchstoneStmt *stmt, uint32_t index, const char *value) {
+    bool found;
+    Column column = param_column(stmt, index, &found);
+    if (!found || column == COLUMN_ID) {
+        return TOUCHSTONE_ERROR_MISUSE;
+    }
+
+    Row *row = &stmt->statement.row_to_insert;
+    size_t len = strlen(value);
+    if (column == COLUMN_USERNAME) {
+        if (len > COLUMN_USERNAME_SIZE) {
+            return TOUCHSTONE_ERROR_OUT_OF_BOUNDS;
+        }
+        memcpy(row->username, value, len + 1);
+    } else {
+        if (len > COLUMN_EMAIL_SIZE) {
+            return TOUCHSTONE_ERROR_OUT_OF_BOUNDS;
+        }
+        memcpy(row->email, value, len + 1);
+    }
+
+    stmt->bound_columns |= 1 << column;
+    return TOUCHSTONE_OK;
+}
+
+void select_close_cursor(TouchstoneStmt *stmt) {
+    // Caller holds the table lock; lets a follower apply batches again once no scan is mid-tree
+    if (stmt->cursor == NULL) {
+        return;
+    }
+    free(stmt->cursor);
+    stmt->cursor = NULL;
+    if (stmt->db->follower != NULL) {
+        replication_scan_closed(stmt->db->follower);
+    }
+}
+
+bool select_next_row(TouchstoneStmt *stmt, Row *row) {
+    ShardedTable *sharded = stmt->db->sharded;
+    if (sharded != NULL) {
+        if (stmt->shard_scan == NULL) {
+            stmt->shard_scan = shard_scan_start(sharded);
+        }
+        return shard_scan_next(stmt->shard_scan, row);
+    }
+
+    if (stmt->cursor == NULL) {
+        stmt->cursor = table_start(stmt->db->table);
+        if (stmt->db->follower != NULL) {
+            replication_scan_opened(stmt->db->follower);
+        }
+    }
+    if (stmt->cursor->end_of_table) {
+        return false;
+    }
+    deserialize_row(cursor_ptr(stmt->cursor), row);
+    cursor_advance(stmt->cursor);
+    return true;
+}
+
+TouchstoneResult select_step(TouchstoneStmt *stmt) {
+    TouchstoneDb *db = stmt->db;
+    SelectSpec *select = &stmt->statement.select;
+    if (select->point) {
+        // At most one row matches, so the next step reports the end
+        stmt->done = true;
+        bool found = db->sharded != NULL ? sharded_lookup(db->sharded, select->key, &stmt->row)
+                                         : table_lookup(db->table, select->key, &stmt->row);
+        return found ? TOUCHSTONE_ROW : TOUCHSTONE_DONE;
+    }
+
+    if (select->ordered) {
+        // The whole input is consumed before the first ordered row can be returned
+        if (stmt->sorter == NULL) {
+            Table *table = db->sharded != NULL ? db->sharded->shards[0].table : db->table;
+            stmt->sorter = new_sorter(select->order_column, select->descending, select->limit,
+                                      table->sort_memory_budget);
+            while (select_next_row(stmt, &stmt->row)) {
+                sorter_add(stmt->sorter, &stmt->row);
+            }
+            select_close_cursor(stmt);
+            sorter_finish(stmt->sorter);
+        }
+        if (!sorter_next(stmt->sorter, &stmt->row)) {
+            stmt->done = true;
+            return TOUCHSTONE_DONE;
+        }
+        return TOUCHSTONE_ROW;
+    }
+
+    if ((select->limit > 0 && stmt->rows_returned == select->limit) || !select_next_row(stmt, &stmt->row)) {
+        stmt->done = true;
+        if (db->sharded == NULL) {
+            select_close_cursor(stmt);
+        }
+        return TOUCHSTONE_DONE;
+    }
+    stmt->rows_returned++;
+    return TOUCHSTONE_ROW;
+}
+
+TouchstoneResult statement_step(TouchstoneStmt *stmt) {
+    Table *table = stmt->db->table;
+    Statement *statement = &stmt->statement;
+    switch (statement->type) {
+        case STATEMENT_INSERT:
+            if ((stmt->bound_columns & statement->param_columns) != statement->param_columns) {
+                return TOUCHSTONE_ERROR_MISUSE;
+            }
+            stmt->done = true;
+            if (stmt->db->sharded != NULL) {
+                // Only queued here; the worker's result comes back from touchstone_sync()
+                sharded_insert(stmt->db->sharded, &statement->row_to_insert);
+                return TOUCHSTONE_DONE;
+            }
+            return execute_result_to_touchstone(table_insert(table, &statement->row_to_insert));
+        case STATEMENT_SELECT:
+            return select_step(stmt);
+        case STATEMENT_COPY:
+            if (stmt->db->sharded != NULL) {
+                return TOUCHSTONE_ERROR_MISUSE;
+            }
+            stmt->done = true;
+            return execute_result_to_touchstone(execute_copy(statement, table));
+        case STATEMENT_DELETE:
+            if (stmt->db->sharded != NULL) {
+                return TOUCHSTONE_ERROR_UNSUPPORTED;
+            }
+            stmt->done = true;
+            return execute_result_to_touchstone(table_delete(table, statement->key_to_delete));
+    }    return TOUCHSTONE_ERROR_MISUSE;
+}
+
+TouchstoneResult touchstone_step(TouchstoneStmt *stmt) {
+    if (stmt->done) {
+        return TOUCHSTONE_DONE;
+    }
+    if (stmt->db->sharded != NULL) {
+        return statement_step(stmt);
+    }
+    if (stmt->db->follower != NULL && stmt->statement.type != STATEMENT_SELECT) {
+        return TOUCHSTONE_ERROR_READ_ONLY;
+    }
+
+    table_lock(stmt->db->table);
+    TouchstoneResult result = statement_step(stmt);
+    table_unlock(stmt->db->table);
+    return result;
+}
+
+void release_cursor(TouchstoneStmt *stmt) {
+    if (stmt->cursor == NULL) {
+        return;
+    }
+    table_lock(stmt->db->table);
+    select_close_cursor(stmt);
+    table_unlock(stmt->db->table);
+}
+
+TouchstoneResult touchstone_reset(TouchstoneStmt *stmt) {
+    // Bindings are kept so an insert can be re-run after rebinding only what changed
+    release_cursor(stmt);
+    if (stmt->shard_scan != NULL) {
+        close_shard_scan(stmt->shard_scan);
+        stmt->shard_scan = NULL;
+    }
+    if (stmt->sorter != NULL) {
+        close_sorter(stmt->sorter);
+        stmt->sorter = NULL;
+    }
+    stmt->rows_returned = 0;
+    stmt->done = false;
+    return TOUCHSTONE_OK;
+}
+
+void touchstone_finalize(TouchstoneStmt *stmt) {
+    if (stmt == NULL) {
+        return;
+    }
+    release_cursor(stmt);
+    if (stmt->shard_scan != NULL) {
+        close_shard_scan(stmt->shard_scan);
+    }
+    if (stmt->sorter != NULL) {
+        close_sorter(stmt->sorter);
+    }
+    free(stmt);
+}
+
+StatementType touchstone_statement_type(TouchstoneStmt *stmt) {
+    return stmt->statement.type;
+}
+
+const Row *touchstone_row(TouchstoneStmt *stmt) {
+    return &stmt->row;
+}
+
+uint32_t touchstone_column_int(TouchstoneStmt *stmt, uint32_t column) {
+    if (column != COLUMN_ID) {
+        return 0;
+    }
+    return stmt->row.id;
+}
+
+const char *touchstone_column_text(TouchstoneStmt *stmt, uint32_t column) {
+    switch (column) {
+        case COLUMN_USERNAME:
+            return stmt->row.username;
+        case COLUMN_EMAIL:
+            return stmt->row.email;
+        default:
+            return NULL;
+    }
+}
@@ -0,0 +1,86 @@
+//
+// Created by Matthew Emerson on 2/8/22.
+//
+
+#ifndef TOUCHSTONE_TOUCHSTONE_H
+#define TOUCHSTONE_TOUCHSTONE_H
+
+#include "db.h"
+#include "sort.h"
+#include "shard.h"
+#include "backup.h"
+#include "replication.h"
+#include "trace.h"
+
+typedef enum {
+    TOUCHSTONE_OK,
+    TOUCHSTONE_ROW,
+    TOUCHSTONE_DONE,
+    TOUCHSTONE_ERROR_UNRECOGNIZED,
+    TOUCHSTONE_ERROR_SYNTAX,
+    TOUCHSTONE_ERROR_OUT_OF_BOUNDS,
+    TOUCHSTONE_ERROR_DUPLICATE_KEY,
+    TOUCHSTONE_ERROR_TABLE_FULL,
+    TOUCHSTONE_ERROR_IO,
+    TOUCHSTONE_ERROR_MISUSE,
+    TOUCHSTONE_ERROR_READ_ONLY,
+    TOUCHSTONE_ERROR_UNSUPPORTED
+} TouchstoneResult;
+
+typedef struct {
+    // Exactly one of these is set
+    Table *table;
+    ShardedTable *sharded;
+    // Most recent online backup, NULL if none has been started
+    Backup *backup;
+    // Page shipping to a follower, or from a primary when this database is a read-only follower
+    ReplicationPrimary *primary;
+    ReplicationFollower *follower;
+    // Page access trace shared by every pager, NULL unless tracing
+    Tracer *tracer;
+} TouchstoneDb;
+
+typedef struct {
+    TouchstoneDb *db;
+    Statement statement;
+    // Placeholder columns bound so far, one bit per Column like Statement.param_columns
+    uint32_t bound_columns;
+    Cursor *cursor;
+    ShardScan *shard_scan;
+    Sorter *sorter;
+    uint32_t rows_returned;
+    Row row;
+    bool done;
+} TouchstoneStmt;
+
+TouchstoneResult touchstone_open(const char *filename, TouchstoneDb **db);
+TouchstoneResult touchstone_open_with_page_size(const char *filename, uint32_t page_size, TouchstoneDb **db);
+TouchstoneResult touchstone_open_with_type(const char *filename, uint32_t page_size, TableType type,
+                                           TouchstoneDb **db);
+TouchstoneResult touchstone_open_sharded(const char *filename, uint32_t num_shards, uint32_t key_span,
+                                         uint32_t page_size, TouchstoneDb **db);
+TouchstoneResult touchstone_open_follower(const char *filename, const char *socket_path, TouchstoneDb **db);
+void touchstone_close(TouchstoneDb *db);
+void touchstone_commit(TouchstoneDb *db);
+// On a sharded database an INSERT steps to TOUCHSTONE_DONE once it is queued, before it runs; its failures,
+// such as a duplicate key, are only reported by the next touchstone_sync()
+TouchstoneResult touchstone_sync(TouchstoneDb *db, uint32_t *num_failed);
+void touchstone_set_sort_memory(TouchstoneDb *db, size_t memory_budget);
+Table *touchstone_table(TouchstoneDb *db);
+TouchstoneResult touchstone_backup(TouchstoneDb *db, const char *path, uint64_t bytes_per_sec);
+TouchstoneResult touchstone_replicate(TouchstoneDb *db, const char *socket_path);
+TouchstoneResult touchstone_trace(TouchstoneDb *db, const char *path);
+
+TouchstoneResult touchstone_prepare(TouchstoneDb *db, const char *sql, TouchstoneStmt **stmt);
+TouchstoneResult touchstone_bind_int(TouchstoneStmt *stmt, uint32_t index, uint32_t value);
+TouchstoneResult touchstone_bind_text(TouchstoneStmt *stmt, uint32_t index, const char *value);
+TouchstoneResult touchstone_step(TouchstoneStmt *stmt);
+TouchstoneResult touchstone_reset(TouchstoneStmt *stmt);
+void touchstone_finalize(TouchstoneStmt *stmt);
+
+StatementType touchstone_statement_type(TouchstoneStmt *stmt);
+const Row *touchstone_row(TouchstoneStmt *stmt);
+uint32_t touchstone_column_int(TouchstoneStmt *stmt, uint32_t column);
+const char *touchstone_column_text(TouchstoneStmt *stmt, uint32_t column);
+
+#endif //TOUCHSTONE_TOUCHSTONE_H
@@ -0,0 +1,139 @@
+//
+// Created by Matthew Emerson on 2/26/22.
+//
+
+#include <memory.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include "trace.h"
+
+void trace_record(Tracer *tracer, uint16_t source, uint32_t page_num, TraceOp op, bool hit) {
+    // Any thread may record; a slot is claimed by advancing head, and dropped if the ring is full
+    uint64_t head = atomic_load_explicit(&tracer->head, memory_order_relaxed);
+    do {
+        if (head - atomic_load_explicit(&tracer->tail, memory_order_acquire) >= TRACE_RING_SIZE) {
+            atomic_fetch_add_explicit(&tracer->dropped, 1, memory_order_relaxed);
+            return;
+        }
+    } while (!atomic_compare_exchange_weak_explicit(&tracer->head, &head, head + 1, memory_order_relaxed,
+                                                    memory_order_relaxed));
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    TraceSlot *slot = &tracer->ring[head % TRACE_RING_SIZE];
+    slot->record.timestamp_ns = (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+    slot->record.page_num = page_num;
+    slot->record.source = source;
+    slot->record.op = op;
+    slot->record.hit = hit;
+    atomic_store_explicit(&slot->ready, head + 1, memory_order_release);
+}
+
+bool trace_write(Tracer *tracer, TraceRecord *records, uint32_t num_records) {
+    size_t len = (size_t) num_records * sizeof(TraceRecord);
+    size_t written = 0;
+    while (written < len) {
+        ssize_t bytes_written = write(tracer->fd, (void *) records + written, len - written);
+        if (bytes_written == -1) {
+            printf("Error: Unable to write trace: %d\n", errno);
+            return false;
+        }
+        written += bytes_written;
+    }
+    tracer->records_written += num_records;
+    return true;
+}
+
+uint32_t trace_drain(Tracer *tracer, TraceRecord *batch) {
+    // Copies out the run of finished records at the tail, then frees their slots for producers
+    uint64_t tail = atomic_load_explicit(&tracer->tail, memory_order_relaxed);
+    uint32_t num_records = 0;
+    while (num_records < TRACE_WRITE_BATCH) {
+        TraceSlot *slot = &tracer->ring[(tail + num_records) % TRACE_RING_SIZE];
+        if (atomic_load_explicit(&slot->ready, memory_order_acquire) != tail + num_records + 1) {
+            break;
+        }
+        batch[num_records++] = slot->record;
+    }
+    atomic_store_explicit(&tracer->tail, tail + num_records, memory_order_release);
+    return num_records;
+}
+
+void *trace_flusher(void *arg) {
+    Tracer *tracer = arg;
+    TraceRecord *batch = malloc(TRACE_WRITE_BATCH * sizeof(TraceRecord));
+    struct timespec interval = {0, TRACE_FLUSH_INTERVAL_MS * 1000000};
+    bool failed = false;
+
+    while (1) {
+        bool stopping = atomic_load(&tracer->stopping);
+        uint32_t num_records;
+        while ((num_records = trace_drain(tracer, batch)) > 0) {
+            if (!failed) {
+                failed = !trace_write(tracer, batch, num_records);
+            }
+        }
+        // Checked before the last drain so records made right up to close are kept
+        if (stopping) {
+            break;
+        }
+        nanosleep(&interval, NULL);
+    }
+
+    free(batch);
+    return NULL;
+}
+
+Tracer *new_tracer(const char *path) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    if (fd == -1) {
+        printf("Error: Unable to open trace '%s': %d\n", path, errno);
+        return NULL;
+    }
+
+    // The header is rewritten with the final counts on close
+    TraceFileHeader header = {0};
+    if (write(fd, &header, sizeof(header)) != sizeof(header)) {
+        printf("Error: Unable to write trace header: %d\n", errno);
+        close(fd);
+        return NULL;
+    }
+
+    Tracer *tracer = malloc(sizeof(Tracer));
+    tracer->fd = fd;
+    tracer->ring = malloc(TRACE_RING_SIZE * sizeof(TraceSlot));
+    for (uint32_t i = 0; i < TRACE_RING_SIZE; i++) {
+        atomic_init(&tracer->ring[i].ready, 0);
+    }
+    tracer->head = 0;
+    tracer->tail = 0;
+    tracer->dropped = 0;
+    tracer->records_written = 0;
+    tracer->stopping = false;
+
+    pthread_create(&tracer->thread, NULL, trace_flusher, tracer);
+    return tracer;
+}
+
+void close_tracer(Tracer *tracer) {
+    // Callers stop recording first; the flusher drains what is left before exiting
+    atomic_store(&tracer->stopping, true);
+    pthread_join(tracer->thread, NULL);
+
+    TraceFileHeader header = {0};
+    memcpy(header.magic, TRACE_MAGIC, sizeof(TRACE_MAGIC));
+    header.version = TRACE_VERSION;
+    header.record_size = sizeof(TraceRecord);
+    header.num_records = tracer->records_written;
+    header.dropped = tracer->dropped;
+    if (pwrite(tracer->fd, &header, sizeof(header), 0) != sizeof(header)) {
+        printf("Error: Unable to write trace header: %d\n", errno);
+    }
+    close(tracer->fd);
+
+    free(tracer->ring);
+    free(tracer);
+}
@@ -0,0 +1,72 @@
+//
+// Created by Matthew Emerson on 2/26/22.
+//
+
+#ifndef TOUCHSTONE_TRACE_H
+#define TOUCHSTONE_TRACE_H
+
+#include <pthread.h>
+#include "db.h"
+
+#define TRACE_MAGIC             "TSTRACE"
+#define TRACE_VERSION           1
+#define TRACE_RING_SIZE         (1 << 16)
+#define TRACE_WRITE_BATCH       4096
+#define TRACE_FLUSH_INTERVAL_MS 10
+
+typedef enum {
+    TRACE_GET_PAGE,
+    TRACE_FLUSH,
+    TRACE_CURSOR_START,
+    TRACE_CURSOR_FIND,
+    TRACE_CURSOR_ADVANCE
+} TraceOp;
+
+// 16 bytes on disk; hit is only meaningful for TRACE_GET_PAGE, where it says the page was already cached
+typedef struct {
+    uint64_t timestamp_ns;
+    uint32_t page_num;
+    // Which file the page belongs to, the shard number for sharded databases
+    uint16_t source;
+    uint8_t op;
+    uint8_t hit;
+} TraceRecord;
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+    uint64_t num_records;
+    uint64_t dropped;
+} TraceFileHeader;
+
+typedef struct {
+    // Sequence number + 1 once the record is fully written, so the flusher never reads a torn slot
+    _Atomic uint64_t ready;
+    TraceRecord record;
+} TraceSlot;
+
+typedef struct Tracer {
+    int fd;
+    pthread_t thread;
+    TraceSlot *ring;
+    _Atomic uint64_t head;
+    _Atomic uint64_t tail;
+    // Records lost because the flusher fell a full ring behind
+    _Atomic uint64_t dropped;
+    uint64_t records_written;
+    _Atomic bool stopping;
+} Tracer;
+
+Tracer *new_tracer(const char *path);
+void close_tracer(Tracer *tracer);
+void trace_record(Tracer *tracer, uint16_t source, uint32_t page_num, TraceOp op, bool hit);
+
+static inline void trace_page(Pager *pager, uint32_t page_num, TraceOp op, bool hit) {
+    // A single branch when tracing is off
+    if (pager->tracer != NULL) {
+        trace_record(pager->tracer, pager->trace_source, page_num, op, hit);
+    }
+}
+
+#endif //TOUCHSTONE_TRACE_H
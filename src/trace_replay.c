@@ -0,0 +1,276 @@
+//
+// Created by Matthew Emerson on 2/26/22.
+//
+
+#include <stdio.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include "trace.h"
+
+#define REPLAY_MAX_POOL_SIZES   32
+#define REPLAY_NONE             UINT32_MAX
+
+// Replays the get_page() requests of a trace through simulated buffer pools:
+//   trace_replay <trace> [pool pages...]
+
+typedef enum {
+    POLICY_LRU,
+    POLICY_CLOCK,
+    POLICY_FIFO,
+    POLICY_OPT
+} Policy;
+
+const char *POLICY_NAMES[] = {"LRU", "CLOCK", "FIFO", "OPT"};
+const uint32_t NUM_POLICIES = 4;
+
+typedef struct {
+    // Dense page ids in request order
+    uint32_t *requests;
+    uint64_t num_requests;
+    uint32_t num_pages;
+    // Index of the next request for the same page, num_requests if none
+    uint64_t *next_use;
+} Workload;
+
+typedef struct {
+    uint64_t key;
+    uint32_t id;
+    bool used;
+} PageSlot;
+
+uint32_t page_id(PageSlot *slots, uint64_t num_slots, uint64_t key, uint32_t *num_pages) {
+    // Open addressing over (source, page) pairs; num_slots is a power of two larger than the distinct count
+    uint64_t i = (key * 0x9e3779b97f4a7c15) & (num_slots - 1);
+    while (slots[i].used && slots[i].key != key) {
+        i = (i + 1) & (num_slots - 1);
+    }
+    if (!slots[i].used) {
+        slots[i].used = true;
+        slots[i].key = key;
+        slots[i].id = (*num_pages)++;
+    }
+    return slots[i].id;
+}
+
+bool load_workload(const char *path, Workload *workload, TraceFileHeader *header) {
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        printf("Error: Unable to open trace '%s'\n", path);
+        return false;
+    }
+    if (fread(header, sizeof(TraceFileHeader), 1, file) != 1 ||
+        memcmp(header->magic, TRACE_MAGIC, sizeof(TRACE_MAGIC)) != 0 ||
+        header->record_size != sizeof(TraceRecord)) {
+        printf("Error: '%s' is not a finished touchstone trace\n", path);
+        fclose(file);
+        return false;
+    }
+
+    workload->requests = malloc((header->num_records + 1) * sizeof(uint32_t));
+    workload->num_requests = 0;
+    workload->num_pages = 0;
+    uint64_t num_slots = 1024;
+    while (num_slots < 2 * header->num_records) {
+        num_slots *= 2;
+    }
+    PageSlot *slots = calloc(num_slots, sizeof(PageSlot));
+    if (workload->requests == NULL || slots == NULL) {
+        printf("Error: Trace '%s' claims too many records to load\n", path);
+        free(workload->requests);
+        free(slots);
+        fclose(file);
+        return false;
+    }
+
+    // Only page requests reach a buffer pool; flushes and cursor steps are left out. Both buffers are sized
+    // from the header, so records past its count are ignored
+    TraceRecord records[TRACE_WRITE_BATCH];
+    uint64_t records_left = header->num_records;
+    size_t num_read;
+    while (records_left > 0 &&
+           (num_read = fread(records, sizeof(TraceRecord),
+                             records_left < TRACE_WRITE_BATCH ? records_left : TRACE_WRITE_BATCH, file)) > 0) {
+        records_left -= num_read;
+        for (size_t i = 0; i < num_read; i++) {
+            if (records[i].op != TRACE_GET_PAGE) {
+                continue;
+            }
+            uint64_t key = ((uint64_t) records[i].source << 32) | records[i].page_num;
+            workload->requests[workload->num_requests++] = page_id(slots, num_slots, key, &workload->num_pages);
+        }
+    }
+    fclose(file);
+    free(slots);
+
+    uint64_t *last_use = malloc(workload->num_pages * sizeof(uint64_t));
+    for (uint32_t i = 0; i < workload->num_pages; i++) {
+        last_use[i] = workload->num_requests;
+    }
+    workload->next_use = malloc(workload->num_requests * sizeof(uint64_t));
+    for (uint64_t i = workload->num_requests; i-- > 0;) {
+        workload->next_use[i] = last_use[workload->requests[i]];
+        last_use[workload->requests[i]] = i;
+    }
+    free(last_use);
+    return true;
+}
+
+uint64_t simulate(Workload *workload, Policy policy, uint32_t pool_size) {
+    // Returns the number of hits; every structure is indexed by page id or frame number
+    uint32_t *frame_of = malloc(workload->num_pages * sizeof(uint32_t));
+    for (uint32_t i = 0; i < workload->num_pages; i++) {
+        frame_of[i] = REPLAY_NONE;
+    }
+    uint32_t *page_in = malloc(pool_size * sizeof(uint32_t));
+    bool *referenced = calloc(pool_size, sizeof(bool));
+    uint64_t *next_use = malloc(pool_size * sizeof(uint64_t));
+    // LRU keeps frames in a doubly linked list, most recent at the head
+    uint32_t *prev = malloc(pool_size * sizeof(uint32_t));
+    uint32_t *next = malloc(pool_size * sizeof(uint32_t));
+    uint32_t lru_head = REPLAY_NONE;
+    uint32_t lru_tail = REPLAY_NONE;
+    uint32_t used = 0;
+    uint32_t hand = 0;
+    uint64_t hits = 0;
+
+    for (uint64_t i = 0; i < workload->num_requests; i++) {
+        uint32_t page = workload->requests[i];
+        uint32_t frame = frame_of[page];
+        bool fresh_frame = false;
+
+        if (frame != REPLAY_NONE) {
+            hits++;
+        } else {
+            if (used < pool_size) {
+                frame = used++;
+                fresh_frame = true;
+            } else {
+                switch (policy) {
+                    case POLICY_LRU:
+                        frame = lru_tail;
+                        break;
+                    case POLICY_CLOCK:
+                        while (referenced[hand]) {
+                            referenced[hand] = false;
+                            hand = (hand + 1) % pool_size;
+                        }
+                        frame = hand;
+                        hand = (hand + 1) % pool_size;
+                        break;
+                    case POLICY_FIFO:
+                        frame = hand;
+                        hand = (hand + 1) % pool_size;
+                        break;
+                    case POLICY_OPT:
+                        // Belady: evict the page needed furthest in the future
+                        frame = 0;
+                        for (uint32_t f = 1; f < pool_size; f++) {
+                            if (next_use[f] > next_use[frame]) {
+                                frame = f;
+                            }
+                        }
+                        break;
+                }
+                frame_of[page_in[frame]] = REPLAY_NONE;
+            }
+            frame_of[page] = frame;
+            page_in[frame] = page;
+        }
+
+        referenced[frame] = true;
+        next_use[frame] = workload->next_use[i];
+        if (policy == POLICY_LRU && (fresh_frame || lru_head != frame)) {
+            if (!fresh_frame) {
+                // Unlink from its current position
+                uint32_t before = prev[frame];
+                uint32_t after = next[frame];
+                if (before != REPLAY_NONE) {
+                    next[before] = after;
+                }
+                if (after != REPLAY_NONE) {
+                    prev[after] = before;
+                } else {
+                    lru_tail = before;
+                }
+            }
+            prev[frame] = REPLAY_NONE;
+            next[frame] = lru_head;
+            if (lru_head != REPLAY_NONE) {
+                prev[lru_head] = frame;
+            }
+            lru_head = frame;
+            if (lru_tail == REPLAY_NONE) {
+                lru_tail = frame;
+            }
+        }
+    }
+
+    free(frame_of);
+    free(page_in);
+    free(referenced);
+    free(next_use);
+    free(prev);
+    free(next);
+    return hits;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        printf("Usage: %s <trace> [pool pages...]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    uint32_t pool_sizes[REPLAY_MAX_POOL_SIZES];
+    uint32_t num_pool_sizes = 0;
+    for (int i = 2; i < argc && num_pool_sizes < REPLAY_MAX_POOL_SIZES; i++) {
+        uint32_t pool_size = strtoul(argv[i], NULL, 10);
+        if (pool_size == 0) {
+            printf("Error: Pool sizes must be positive page counts\n");
+            exit(EXIT_FAILURE);
+        }
+        pool_sizes[num_pool_sizes++] = pool_size;
+    }
+
+    Workload workload;
+    TraceFileHeader header;
+    if (!load_workload(argv[1], &workload, &header)) {
+        exit(EXIT_FAILURE);
+    }
+    if (num_pool_sizes == 0) {
+        // Default to powers of two up to the point where every page fits
+        for (uint32_t pool_size = 1; num_pool_sizes < REPLAY_MAX_POOL_SIZES; pool_size *= 2) {
+            pool_sizes[num_pool_sizes++] = pool_size;
+            if (pool_size >= workload.num_pages) {
+                break;
+            }
+        }
+    }
+
+    printf("Trace: %" PRIu64 " records, %" PRIu64 " dropped, %" PRIu64 " page requests, %d distinct pages\n", header.num_records,
+           header.dropped, workload.num_requests, workload.num_pages);
+    if (workload.num_requests == 0) {
+        return EXIT_SUCCESS;
+    }
+    // Distinct pages miss under every policy, so this bounds every hit ratio
+    printf("Best possible hit ratio: %.2f%%\n",
+           100.0 * (double) (workload.num_requests - workload.num_pages) / (double) workload.num_requests);
+
+    printf("%10s", "pool");
+    for (uint32_t p = 0; p < NUM_POLICIES; p++) {
+        printf("%10s", POLICY_NAMES[p]);
+    }
+    printf("\n");
+    for (uint32_t i = 0; i < num_pool_sizes; i++) {
+        printf("%10d", pool_sizes[i]);
+        for (uint32_t p = 0; p < NUM_POLICIES; p++) {
+            uint64_t hits = simulate(&workload, p, pool_sizes[i]);
+            printf("%9.2f%%", 100.0 * (double) hits / (double) workload.num_requests);
+        }
+        printf("\n");
+    }
+
+    free(workload.requests);
+    free(workload.next_use);
+    return EXIT_SUCCESS;
+}
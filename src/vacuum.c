@@ -0,0 +1,160 @@
+//
+// Created by Matthew Emerson on 2/10/22.
+//
+
+#include <stdio.h>
+#include "vacuum.h"
+#include "learned.h"
+
+uint32_t vacuum_layout(Table *table, uint32_t *layout) {
+    // Target order: root, remaining internal nodes breadth first, then leaves in key order
+    Pager *pager = table->pager;
+    uint32_t leaves[TABLE_MAX_PAGES];
+    uint32_t num_internal = 0;
+    uint32_t num_leaves = 0;
+
+    layout[num_internal++] = table->root_page_num;
+    for (uint32_t i = 0; i < num_internal; i++) {
+        void *node = get_page(pager, layout[i]);
+        if (get_node_type(node) == LEAF_NODE) {
+            leaves[num_leaves++] = layout[i];
+            continue;
+        }
+        uint32_t num_keys = *internal_node_num_keys(node);
+        for (uint32_t child = 0; child <= num_keys; child++) {
+            layout[num_internal++] = *internal_node_child(node, child);
+        }
+    }
+
+    // Breadth first order visits leaves left to right, so compact them after the internal nodes
+    uint32_t len = 0;
+    for (uint32_t i = 0; i < num_internal; i++) {
+        if (get_node_type(get_page(pager, layout[i])) == INTERNAL_NODE) {
+            layout[len++] = layout[i];
+        }
+    }
+    for (uint32_t i = 0; i < num_leaves; i++) {
+        layout[len++] = leaves[i];
+    }
+    return len;
+}
+
+uint32_t rename_page(uint32_t page_num, uint32_t a, uint32_t b) {
+    if (page_num == a) {
+        return b;
+    }
+    if (page_num == b) {
+        return a;
+    }
+    return page_num;
+}
+
+bool rename_pointer(uint32_t *page_num, uint32_t a, uint32_t b) {
+    // Returns whether the pointer changed, so only nodes that really point at a or b get rewritten
+    uint32_t renamed = rename_page(*page_num, a, b);
+    if (renamed == *page_num) {
+        return false;
+    }
+    *page_num = renamed;
+    return true;
+}
+
+void vacuum_swap_pages(Table *table, uint32_t *layout, uint32_t layout_len, uint32_t a, uint32_t b) {
+    Pager *pager = table->pager;
+    get_page(pager, a);
+    get_page(pager, b);
+
+    void *page = pager->pages[a];
+    pager->pages[a] = pager->pages[b];
+    pager->pages[b] = page;
+
+    for (uint32_t i = 0; i < layout_len; i++) {
+        layout[i] = rename_page(layout[i], a, b);
+    }
+    for (uint32_t i = 0; i < pager->num_free_pages; i++) {
+        pager->free_pages[i] = rename_page(pager->free_pages[i], a, b);
+    }
+
+    pager_mark_dirty(pager, a);
+    pager_mark_dirty(pager, b);
+
+    // Page 0 is never renamed, so zero parent and next-leaf terminators are left alone
+    for (uint32_t i = 0; i < layout_len; i++) {
+        void *node = get_page(pager, layout[i]);
+        bool changed = rename_pointer(node_parent(node), a, b);
+        switch (get_node_type(node)) {
+            case INTERNAL_NODE: {
+                uint32_t num_keys = *internal_node_num_keys(node);
+                for (uint32_t child = 0; child <= num_keys; child++) {
+                    changed |= rename_pointer(internal_node_child(node, child), a, b);
+                }
+                break;
+            }
+            case LEAF_NODE:
+                changed |= rename_pointer(leaf_node_next_leaf(node), a, b);
+                break;
+        }
+        if (changed) {
+            pager_mark_dirty(pager, layout[i]);
+        }
+    }
+}
+
+VacuumResult vacuum_step(Table *table, uint32_t max_moves, VacuumStats *stats) {
+    // Runs under the table lock; the tree is consistent after every step, so the lock can be dropped between them
+    if (table->pager->type == TABLE_HASH) {
+        // Buckets are found through the directory, not parent and sibling links, so swaps would corrupt them
+        return VACUUM_ERROR_UNSUPPORTED;
+    }
+    if (table->num_pinned > 0) {
+        // Pinned snapshots read pages in place, and vacuum moves and truncates them
+        return VACUUM_ERROR_SNAPSHOT_PINNED;
+    }
+    if (table->copy_on_write && table->root_page_num != 0) {
+        // Swaps treat page 0 as the root; bring it back there and repair the links copying left stale
+        relink_tree(table);
+    }
+
+    uint32_t layout[TABLE_MAX_PAGES];
+    uint32_t layout_len = vacuum_layout(table, layout);
+
+    uint32_t moves = 0;
+    for (uint32_t slot = 0; slot < layout_len && moves < max_moves; slot++) {
+        if (layout[slot] == slot) {
+            continue;
+        }
+        vacuum_swap_pages(table, layout, layout_len, slot, layout[slot]);
+        stats->pages_moved++;
+        moves++;
+    }
+
+    if (moves == 0) {
+        vacuum_finish(table, layout_len, stats);
+    }
+    if (table->learned_index != NULL) {
+        // The model maps keys to page numbers, and statements may run before the next step
+        learned_index_build(table->learned_index, table);
+    }
+    return moves == 0 ? VACUUM_DONE : VACUUM_MORE;
+}
+
+void vacuum_finish(Table *table, uint32_t layout_len, VacuumStats *stats) {
+    // Everything past the packed tree is unreachable, e.g. pages left behind by copy-on-write
+    stats->pages_released = table->pager->num_pages - layout_len;
+    pager_truncate(table->pager, layout_len);
+    stats->num_pages = layout_len;
+}
+
+VacuumResult vacuum(Table *table, VacuumStats *stats) {
+    // Takes the table lock for one step at a time and commits each step before releasing it
+    VacuumResult result;
+    do {
+        table_lock(table);
+        result = vacuum_step(table, VACUUM_STEP_PAGES, stats);
+        if (result == VACUUM_MORE || result == VACUUM_DONE) {
+            commit_db(table);
+        }
+        table_unlock(table);
+    } while (result == VACUUM_MORE);
+    return result;
+}
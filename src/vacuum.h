@@ -0,0 +1,31 @@
+//
+// Created by Matthew Emerson on 2/10/22.
+//
+
+#ifndef TOUCHSTONE_VACUUM_H
+#define TOUCHSTONE_VACUUM_H
+
+#include "db.h"
+
+#define VACUUM_STEP_PAGES 8
+
+typedef enum {
+    VACUUM_MORE,
+    VACUUM_DONE,
+    VACUUM_ERROR_SNAPSHOT_PINNED,
+    VACUUM_ERROR_UNSUPPORTED
+} VacuumResult;
+
+typedef struct {
+    uint32_t pages_moved;
+    uint32_t pages_released;
+    uint32_t num_pages;
+} VacuumStats;
+
+uint32_t vacuum_layout(Table *table, uint32_t *layout);
+void vacuum_swap_pages(Table *table, uint32_t *layout, uint32_t layout_len, uint32_t a, uint32_t b);
+VacuumResult vacuum_step(Table *table, uint32_t max_moves, VacuumStats *stats);
+void vacuum_finish(Table *table, uint32_t layout_len, VacuumStats *stats);
+VacuumResult vacuum(Table *table, VacuumStats *stats);
+
+#endif //TOUCHSTONE_VACUUM_H